@@ -19,28 +19,106 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/transform.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <unordered_map>
 
 NORI_NAMESPACE_BEGIN
 
 static constexpr uint32_t MAX_TRIANGLES_PER_NODE = 15;
 static constexpr uint32_t MAX_RECURSION_DEPTH = 10;
-static constexpr uint32_t MAX_NUM_MESHES = 32;
+
+static constexpr uint32_t BVH_NUM_BINS = 16;      ///< Number of SAH bins per axis
+static constexpr uint32_t BVH_MAX_DEPTH = 64;     ///< Nodes below this depth are always leaves
+static constexpr float    BVH_TRAVERSAL_COST = 1.f;
+static constexpr float    BVH_INTERSECTION_COST = 1.f;
+static constexpr float    SBVH_OVERLAP_THRESHOLD = 1e-5f; ///< Spatial splits are tried where the object split children overlap by more than this fraction of the root area
+
+static constexpr uint32_t PARALLEL_BUILD_THRESHOLD = 4096; ///< Nodes with fewer triangles are built by a single task
+static constexpr uint32_t PARALLEL_BUILD_GRAIN_SIZE = 1024;
+
+static constexpr uint32_t REFIT_PARALLEL_DEPTH = 6;  ///< Nodes above this depth refit their children in parallel
+static constexpr float    REFIT_MAX_SAH_INCREASE = 1.5f; ///< Accel::refit() rebuilds when the SAH cost grows by more than this factor
+
+static constexpr uint32_t TRAVERSAL_STACK_SIZE = 128;  ///< Enough for 10 octree or 64 BVH levels
+
+/// The far distances of the box tests are enlarged by 1 + 2 gamma(3), so that rounding never culls a box the ray touches
+static constexpr float    BOX_FAR_SCALE = 1.f + 4.f * std::numeric_limits<float>::epsilon();
+
+static constexpr uint32_t SIMD_PACKET_SIZE = 4;        ///< Triangles per SoA packet (one SSE register)
+static constexpr uint32_t MAX_RAY_PACKET_SIZE = 16;    ///< Maximum number of rays per Accel::rayIntersectPacket() query
 
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * Three hierarchies are supported and can be selected with the \c accel
+ * property of the scene:
+ *
+ * - \c "bvh" (default): binary bounding volume hierarchy built with the
+ *   binned surface area heuristic. Every triangle is referenced exactly once.
+ *
+ * - \c "octree": fixed midpoint subdivision into eight children, triangles
+ *   are duplicated into every child they overlap.
+ *
+ * - \c "sbvh": BVH that chooses between partitioning the triangles and
+ *   splitting them with a plane by the SAH (spatial splits). Triangles are
+ *   clipped against the plane, so long diagonal triangles are referenced by
+ *   several tight leaves instead of one large box. The number of additional
+ *   references is limited by \ref setSplitBudget().
+ *
+ * The structure has two levels. The bottom level consists of hierarchies
+ * of the selected type: one over all meshes that are placed without a
+ * transformation, and one per transformed mesh in its object space. The
+ * top level is a BVH over the (transformed) bounding boxes of all
+ * instances of these hierarchies, so placing a mesh several times only
+ * costs one instance record per copy.
  */
 class Accel {
+public:
+    /// Work done by single ray queries, see \ref rayIntersect() and \ref setCollectStatistics()
+    struct TraversalStatistics {
+        uint64_t rays = 0;             ///< Calls of rayIntersect() and occluded()
+        uint64_t nodes_visited = 0;    ///< Nodes popped from the traversal stacks, top and bottom levels
+        uint64_t boxes_tested = 0;     ///< Ray-box tests, including the root boxes
+        uint64_t triangles_tested = 0; ///< Ray-triangle tests, the SIMD kernels always test whole packets
+
+        TraversalStatistics &operator+=(const TraversalStatistics &other) {
+            rays += other.rays;
+            nodes_visited += other.nodes_visited;
+            boxes_tested += other.boxes_tested;
+            triangles_tested += other.triangles_tested;
+            return *this;
+        }
+    };
+
+    /**
+     * \brief Closest hit of a ray without any surface information
+     *
+     * This is all that the traversal finds. It suffices for queries that
+     * only need the distance or the mesh (e.g. whether an emitter was hit),
+     * the position, texture coordinates and frames are computed on demand
+     * by \ref computeSurfaceInteraction().
+     */
+    struct HitRecord {
+        uint32_t instance_idx;
+        uint32_t mesh_idx;
+        uint32_t triangle_idx;
+        float u, v;         ///< Barycentric coordinates on the triangle
+        float t;            ///< Distance along the ray
+        const Mesh *mesh;   ///< Mesh of the triangle
+    };
 
+private:
+    /// Node of the pointer based tree that is produced by the builders
     struct Node {
         uint32_t num_triangles = 0;
+        uint32_t axis = 0;
         BoundingBox3f bbox;
         Node* next = nullptr;
         Node* child = nullptr;
-        uint32_t* triangle_indices = nullptr;
-        uint32_t* mesh_indices = nullptr;
+        uint32_t* triangle_indices = nullptr; ///< Instance indices in the top level
+        uint32_t* mesh_indices = nullptr;     ///< Unused in the top level
 
         ~Node() {
             delete[] triangle_indices;
@@ -50,8 +128,166 @@ class Accel {
         }
     };
 
+    /**
+     * \brief Node of the flattened hierarchy used for traversal
+     *
+     * All children of an interior node are stored next to each other,
+     * starting at \c offset. Leaves reference \c num_triangles
+     * consecutive entries of the triangle and mesh reference buffers (or
+     * of the instance reference buffer in the top level), starting at
+     * \c offset.
+     */
+    struct alignas(32) LinearNode {
+        BoundingBox3f bbox;
+        uint32_t offset;
+        uint32_t num_triangles : 24;
+        uint32_t num_children : 6;
+        uint32_t axis : 2;
+    };
+
+    /**
+     * \brief Node of a compressed hierarchy, see \ref ENodeFormat
+     *
+     * Same topology as \ref LinearNode, but the box is stored in fixed
+     * point relative to the (decoded) box of the parent node and rounded
+     * outwards. Decoding therefore needs the box of the parent, which the
+     * traversal loops keep on their stacks.
+     */
+    template <typename T> struct QuantizedNode {
+        T bbox_min[3];
+        T bbox_max[3];
+        uint32_t offset;
+        uint32_t num_triangles : 24;
+        uint32_t num_children : 6;
+        uint32_t axis : 2;
+    };
+
+    /// Node on the traversal stacks, quantized nodes also carry their decoded box
+    template <typename NodeType> struct NodeRef {
+        uint32_t node_idx;
+
+        static NodeRef make(uint32_t node_idx, const BoundingBox3f&) { return NodeRef { node_idx }; }
+    };
+    template <typename T> struct NodeRef<QuantizedNode<T>> {
+        uint32_t node_idx;
+        float bbox_min[3];
+        float bbox_max[3];
+
+        static NodeRef make(uint32_t node_idx, const BoundingBox3f& bbox) {
+            return NodeRef { node_idx, { bbox.min.x(), bbox.min.y(), bbox.min.z() },
+                                       { bbox.max.x(), bbox.max.y(), bbox.max.z() } };
+        }
+    };
+
+    /// Entry of the traversal stack, remembers where the ray enters the node
+    template <typename NodeType> struct StackEntry {
+        NodeRef<NodeType> node;
+        float near_t;
+    };
+
+    /**
+     * \brief Precomputed leaf triangles in SoA layout
+     *
+     * Stores the first vertex and both edges of \ref SIMD_PACKET_SIZE
+     * triangles, so that the leaf tests read them sequentially instead of
+     * gathering the vertices through the index buffers of the meshes. For
+     * the SIMD kernels, leaves are padded to a multiple of the packet size
+     * by repeating their last triangle.
+     *
+     * In watertight mode (see \ref setWatertight()) \c edge1 and \c edge2
+     * hold the second and third vertex instead: edges would round
+     * differently in the two triangles sharing them.
+     */
+    struct alignas(16) TrianglePacket {
+        float v0[3][SIMD_PACKET_SIZE];
+        float edge1[3][SIMD_PACKET_SIZE];
+        float edge2[3][SIMD_PACKET_SIZE];
+    };
+
+    /// Entry of the packet traversal stack, remembers which rays entered the parent node
+    template <typename NodeType> struct PacketStackEntry {
+        NodeRef<NodeType> node;
+        uint32_t mask;
+    };
+
+    /// Rays of a packet query in SoA layout, unused lanes never hit anything
+    struct alignas(32) RayPacket {
+        float o[3][MAX_RAY_PACKET_SIZE];
+        float dRcp[3][MAX_RAY_PACKET_SIZE]; ///< Reciprocal direction, infinities are replaced by +/- FLT_MAX
+        float mint[MAX_RAY_PACKET_SIZE];
+        float maxt[MAX_RAY_PACKET_SIZE];
+    };
+
+    /// Per-ray constants of the leaf tests and the SIMD kernels
+    struct SIMDRay {
+        float o[3];
+        float d[3];
+        float dRcp[3]; ///< Reciprocal direction, infinities are replaced by +/- FLT_MAX
+        float mint;
+        /* Ray space of the watertight test: the direction is mapped to +z by
+           permuting the axes (k) and shearing x and y (shear) */
+        int k[3];
+        float shear[3];
+        TraversalStatistics* stats; ///< Counters of the query, \c nullptr if its work is not counted
+    };
+
+    /// Rays of a packet query with their per-ray SIMD constants
+    struct PacketQuery {
+        Ray3f rays[MAX_RAY_PACKET_SIZE];
+        SIMDRay simd_rays[MAX_RAY_PACKET_SIZE];
+        RayPacket packet;
+        uint32_t count;
+        uint32_t active; ///< Rays that still need to be traced
+    };
+
+    /// Placed copy of a bottom level hierarchy
+    struct InstanceData {
+        uint32_t group_idx;
+        bool transformed;   ///< Is \c to_world different from the identity?
+        Transform to_world;
+        Transform to_local;
+    };
+
+    /// Triangle or instance reference used while building the BVH (see accel.cpp)
+    struct BVHPrimitive;
+    /// Split candidate of the BVH builders (see accel.cpp)
+    struct BVHSplit;
+
 public:
-    ~Accel() { delete m_root; }
+    /// Supported hierarchy types
+    enum EType {
+        EBVH = 0,
+        EOctree,
+        ESBVH
+    };
+
+    /// Storage formats of the flattened nodes
+    enum ENodeFormat {
+        EFullPrecision = 0, ///< Boxes as 32 bit floats, 32 bytes per node
+        EQuantized16,       ///< Boxes as 16 bit fixed point relative to the parent, 20 bytes per node
+        EQuantized8         ///< Boxes as 8 bit fixed point relative to the parent, 16 bytes per node
+    };
+
+    /// Instruction sets supported by the traversal kernels
+    enum ESIMDLevel {
+        ESIMDNone = 0,
+        ESIMDSSE,
+        ESIMDAVX2
+    };
+
+    /**
+     * \brief Create an empty acceleration data structure of the given type
+     *
+     * \param simd
+     *    Use the widest SIMD kernels supported by the CPU. When \c false
+     *    (or on CPUs without SSE), the scalar code path is used.
+     *
+     * \param node_format
+     *    Storage format of the nodes. The quantized formats trade looser
+     *    boxes and decoding work during traversal for less memory.
+     */
+    Accel(EType type = EBVH, bool simd = true, ENodeFormat node_format = EFullPrecision)
+        : m_type(type), m_simd(simd), m_node_format(node_format) { }
 
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
@@ -59,14 +295,116 @@ public:
      *
      * This function can only be used before \ref build() is called
      */
-    void addMesh(Mesh *mesh);
+    void addMesh(Mesh *mesh) { addInstance(mesh, Transform()); }
+
+    /**
+     * \brief Place a copy of a triangle mesh with the given transformation
+     *
+     * All transformed instances of a mesh share its hierarchy. This
+     * function can only be used before \ref build() is called
+     */
+    void addInstance(Mesh *mesh, const Transform &toWorld);
+
+    /**
+     * \brief Limit the references that spatial splits of the \c "sbvh"
+     * hierarchy may add, as a fraction of the number of triangles
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setSplitBudget(float budget) { m_split_budget = budget; }
 
-    /// Build the acceleration data structure (currently a no-op)
+    /**
+     * \brief Use the watertight ray-triangle test of Woop et al.
+     *
+     * Rays through a shared edge or vertex then always hit at least one of
+     * the adjacent triangles, which closes the cracks that let shadow rays
+     * leak through closed meshes. Slightly slower than the default
+     * Moeller-Trumbore test. This function can only be used before
+     * \ref build() is called
+     */
+    void setWatertight(bool watertight) { m_watertight = watertight; }
+
+    /**
+     * \brief Keep the built hierarchies in a cache file
+     *
+     * When the file exists and was written for the same meshes,
+     * transformations and settings, \ref build() loads the hierarchies from
+     * it instead of building them. Otherwise the file is (over)written after
+     * the build. An empty filename disables the cache.
+     */
+    void setCacheFile(const std::string &filename) { m_cache_file = filename; }
+
+    /// Build the acceleration data structure
     void build();
 
+    /**
+     * \brief Update the hierarchies after the vertex positions of meshes were
+     * changed (see \ref Mesh::setVertexPositions())
+     *
+     * The boxes of all nodes are recomputed bottom-up, the topology of the
+     * hierarchies is kept. When this increases the SAH cost by more than
+     * \ref REFIT_MAX_SAH_INCREASE relative to the last build, everything is
+     * rebuilt instead. Only the full precision BVH is refitted: quantized
+     * nodes, the octree and the SBVH (whose leaves are clipped to their
+     * cells and splits) are always rebuilt.
+     *
+     * \return \c true if the hierarchies had to be rebuilt
+     */
+    bool refit();
+
+    /// Return the hierarchy type
+    EType getType() const { return m_type; }
+
+    /// Return a human-readable name of the hierarchy type
+    const char *getTypeName() const {
+        return m_type == EOctree ? "Octree" : (m_type == ESBVH ? "SBVH" : "BVH");
+    }
+
+    /// Return the storage format of the nodes
+    ENodeFormat getNodeFormat() const { return m_node_format; }
+
+    /// Return whether the watertight ray-triangle test is used
+    bool isWatertight() const { return m_watertight; }
+
+    /// Return the SIMD kernels selected by \ref build()
+    ESIMDLevel getSIMDLevel() const { return m_simd_level; }
+
+    /// Query the widest instruction set supported by both the CPU and this build
+    static ESIMDLevel detectSIMDLevel();
+
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
+    /// Return the time taken by the last \ref build() (or cache load) in milliseconds
+    float getBuildTime() const { return m_build_time; }
+
+    /// Return the number of nodes of all hierarchies
+    uint32_t getNodeCount() const { return m_num_nodes; }
+
+    /// Return the SAH cost, averaged over the bottom level hierarchies
+    float getSAHCost() const { return m_sah_cost; }
+
+    /// Memory used by the flattened hierarchies and the instances in bytes
+    size_t getMemoryUsage() const;
+
+    /**
+     * \brief Count the work done by all calls of \ref rayIntersect() and
+     * \ref occluded()
+     *
+     * Every thread counts into its own \ref TraversalStatistics, so the
+     * counters need no synchronization. Queries that are given their own
+     * counters only count into those. They cost a few percent of
+     * traversal performance and are disabled by default. The packet
+     * queries are not counted.
+     */
+    void setCollectStatistics(bool collect) { m_collect_statistics = collect; }
+
+    /// Return the sum of the statistics counted by all threads
+    TraversalStatistics getStatistics() const;
+
+    /// Reset the statistics of all threads
+    void resetStatistics() { m_statistics.clear(); }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
      * return detailed intersection information
@@ -79,25 +417,261 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
-     * \param shadowRay
-     *    \c true if this is a shadow ray query, i.e. a query that only aims to
-     *    find out whether the ray is blocked or not without returning detailed
-     *    intersection information.
+     * \param stats
+     *    Optional counters, the work done by this query is added to them
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, Intersection &its, TraversalStatistics *stats = nullptr) const;
+
+    /**
+     * \brief Find the closest intersection of a ray without computing
+     * the surface information
+     *
+     * Together with \ref computeSurfaceInteraction() this is equivalent
+     * to the other \ref rayIntersect(), but callers that only need the
+     * distance or the mesh of the hit skip the shading computations.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, HitRecord &hit, TraversalStatistics *stats = nullptr) const;
+
+    /// Compute the position, texture coordinates and frames of a hit found by \ref rayIntersect()
+    void computeSurfaceInteraction(const HitRecord &hit, Intersection &its) const;
+
+    /**
+     * \brief Check whether a ray segment is blocked by any triangle
+     *
+     * This is the shadow ray query: it stops at the first intersection
+     * found, visits the nodes in no particular order and does not compute
+     * any information about the intersection.
+     *
+     * \param stats
+     *    Optional counters, the work done by this query is added to them
      *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+    bool occluded(const Ray3f &ray, TraversalStatistics *stats = nullptr) const;
+
+    /**
+     * \brief Intersect a packet of rays against all triangles stored in the
+     * scene
+     *
+     * The rays traverse the hierarchy together, so that every node is
+     * fetched once for the whole packet instead of once per ray. This pays
+     * off for coherent rays, e.g. camera rays of neighbouring pixels.
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records. Only the records of rays
+     *    that hit something are filled
+     *
+     * \param count
+     *    Number of rays, at most \ref MAX_RAY_PACKET_SIZE
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const;
+
+    /// Packet version of \ref occluded(), returns the bit mask of blocked rays
+    uint32_t occludedPacket(const Ray3f *rays, uint32_t count) const;
 
 private:
+    /// Release the flattened hierarchies
+    void clear();
+    /// Recompute the boxes of a subtree of the flattened hierarchy, returns its SAH cost (not normalized)
+    float refitRecursive(uint32_t node_idx, uint32_t recursion_depth, bool top_level);
+    /// Average of the normalized SAH costs of all groups, weighted by their triangle counts
+    float averageSAHCost(const std::vector<float>& group_costs) const;
+    /// Statistics of the calling thread, or \c nullptr if they are not collected
+    TraversalStatistics* localStatistics() const {
+        return m_collect_statistics ? &m_statistics.local() : nullptr;
+    }
+
+    /* Cache file (accel_cache.cpp). The key hashes the meshes, instances
+       and build settings, loading fails if it differs from the stored one. */
+    uint64_t computeCacheKey() const;
+    bool loadCache(uint64_t key);
+    bool saveCache(uint64_t key) const;
+
+    Node* buildGroup(const std::vector<uint32_t>& group);
     Node* buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
             std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth);
-    bool traverseRecursive(const Node& node, Ray3f &ray, Intersection &its, bool shadowRay, uint32_t& hit_idx) const;
+    void flatten(const Node* node, uint32_t node_idx, uint32_t recursion_depth, bool top_level);
+    void buildTrianglePackets(uint32_t first_ref);
+    BoundingBox3f getInstanceBoundingBox(const InstanceData& instance) const;
+    static void initSIMDRay(const Ray3f& ray, SIMDRay& simd_ray);
+    void initPacketQuery(const Ray3f* rays, uint32_t count, PacketQuery& query) const;
+
+    /// Convert the flattened hierarchies into a quantized node format
+    template <typename T> void quantize(std::vector<QuantizedNode<T>, tbb::cache_aligned_allocator<QuantizedNode<T>>>& nodes,
+            float& sah_cost) const;
+    /// Quantize the children of a node with the given (decoded) box, returns the SAH cost of the subtree
+    template <typename T> float quantizeChildren(QuantizedNode<T>* nodes, uint32_t node_idx, const BoundingBox3f& bbox) const;
+
+    /* Node access of the traversal loops. Full precision nodes are used in
+       place, quantized nodes are decoded into LinearNodes: a node from the
+       box on the stack, its children relative to that box. */
+    template <typename T> const QuantizedNode<T>* getQuantizedNodes() const;
+    const LinearNode& loadNode(const NodeRef<LinearNode>& ref) const { return m_nodes[ref.node_idx]; }
+    template <typename T> LinearNode loadNode(const NodeRef<QuantizedNode<T>>& ref) const;
+    const LinearNode* loadChildren(const NodeRef<LinearNode>&, const LinearNode& node, LinearNode*) const {
+        return &m_nodes[node.offset];
+    }
+    template <typename T> const LinearNode* loadChildren(const NodeRef<QuantizedNode<T>>&, const LinearNode& node,
+            LinearNode* children) const;
+
+    /* Generic traversal loops, shared by both levels and all node formats. The
+       leaf function is called for every leaf that overlaps the ray segment. */
+    template <typename NodeType, typename LeafFunction>
+    bool traverse(uint32_t root, const BoundingBox3f& root_bbox, Ray3f& ray, const SIMDRay& simd_ray,
+            const LeafFunction& leaf_function) const;
+    template <typename NodeType, typename LeafFunction>
+    bool traverseAnyHit(uint32_t root, const BoundingBox3f& root_bbox, const Ray3f& ray, const SIMDRay& simd_ray,
+            const LeafFunction& leaf_function) const;
+    template <typename NodeType, typename LeafFunction>
+    void traversePacket(uint32_t root, const BoundingBox3f& root_bbox, PacketQuery& query, uint32_t mask,
+            const LeafFunction& leaf_function) const;
+
+    uint32_t intersectChildren(const LinearNode* children, uint32_t num_children, const Ray3f& ray,
+            const SIMDRay& simd_ray, float* near_t) const;
+
+    /* Bottom level queries, the ray is given in object space of the hierarchy */
+    template <typename NodeType>
+    bool intersectGroup(uint32_t instance_idx, Ray3f& ray, const SIMDRay& simd_ray, HitRecord& hit) const;
+    template <typename NodeType>
+    bool occludedGroup(uint32_t group_idx, const Ray3f& ray, const SIMDRay& simd_ray) const;
+    template <typename NodeType>
+    void tracePacketGroup(uint32_t instance_idx, PacketQuery& query, uint32_t mask, bool any_hit,
+            HitRecord* hits, uint32_t& found) const;
+
+    /* Top level queries, transform the ray into object space if needed */
+    template <typename NodeType>
+    bool intersectInstance(uint32_t instance_idx, Ray3f& ray, const SIMDRay& simd_ray, HitRecord& hit) const;
+    template <typename NodeType>
+    bool occludedInstance(uint32_t instance_idx, const Ray3f& ray, const SIMDRay& simd_ray) const;
+    template <typename NodeType>
+    void tracePacketInstance(uint32_t instance_idx, PacketQuery& query, uint32_t mask, bool any_hit,
+            HitRecord* hits, uint32_t& found) const;
+
+    /* Scene queries for one node format, see \ref rayIntersect(), \ref occluded() and \ref rayIntersectPacket() */
+    template <typename NodeType> bool intersectScene(const Ray3f &ray, HitRecord &hit, TraversalStatistics *stats) const;
+    template <typename NodeType> bool occludedScene(const Ray3f &ray, TraversalStatistics *stats) const;
+    template <typename NodeType>
+    uint32_t tracePacketScene(const Ray3f *rays, Intersection *its, uint32_t count, bool any_hit) const;
+
+    /// Find the closest triangle of a leaf within the ray segment
+    bool intersectLeaf(const LinearNode& node, const Ray3f& ray, const SIMDRay& simd_ray,
+            uint32_t& ref, float& u, float& v, float& t) const;
+
+    /// Check whether any triangle of a leaf intersects the ray segment
+    bool occludedLeaf(const LinearNode& node, const Ray3f& ray, const SIMDRay& simd_ray) const;
+
+    /// Cost of intersecting a leaf, the SIMD kernels always test whole packets
+    float intersectionCost(uint32_t num_triangles) const {
+        if (m_simd_level != ESIMDNone)
+            num_triangles = (num_triangles + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE;
+        return BVH_INTERSECTION_COST * num_triangles;
+    }
+
+    /// Moeller-Trumbore test against one lane of a packet, same conventions as Mesh::rayIntersect()
+    static bool intersectTriangle(const TrianglePacket& packet, uint32_t lane, const SIMDRay& ray,
+            float& u, float& v, float& t);
+
+    /**
+     * Watertight test of Woop et al. against one lane of a packet that stores
+     * the three vertices. The vertices are transformed into a space where the
+     * ray starts at the origin and points along +z, the 2D edge functions of
+     * the projected triangle then only depend on the two vertices of each edge
+     * and agree exactly between neighbouring triangles. Edges and vertices
+     * count as inside, so a ray through them hits at least one of the
+     * adjacent triangles.
+     */
+    static bool intersectTriangleWatertight(const TrianglePacket& packet, uint32_t lane, const SIMDRay& ray,
+            float& u, float& v, float& t);
+
+    /// Scalar leaf test on the precomputed triangles, same conventions as the SIMD leaf kernels
+    int intersectLeafScalar(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const;
+
+    /* SIMD kernels (accel_simd.cpp). The children kernels return a bit mask of
+       the children hit by the ray segment, the leaf kernels the index of the
+       closest triangle within the leaf or -1. */
+    static uint32_t intersectChildrenSSE(const LinearNode* children, uint32_t num_children, const SIMDRay& ray,
+            float maxt, float* near_t);
+    static uint32_t intersectChildrenAVX2(const LinearNode* children, uint32_t num_children, const SIMDRay& ray,
+            float maxt, float* near_t);
+    int intersectLeafSSE(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const;
+    int intersectLeafAVX2(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const;
+    /* Packet kernels, test one node against the first \c count rays and return the mask of rays that hit it */
+    static uint32_t intersectNodePacketSSE(const LinearNode& node, const RayPacket& rays, uint32_t count);
+    static uint32_t intersectNodePacketAVX2(const LinearNode& node, const RayPacket& rays, uint32_t count);
+
+    /// Intersect a box with the current ray segment, same slab test as the SIMD kernels
+    static bool intersectBox(const BoundingBox3f& bbox, const Ray3f& ray, float& near_t) {
+        float far_t = ray.maxt;
+        near_t = ray.mint;
+        for (int axis = 0; axis < 3; axis++) {
+            float t0 = (bbox.min[axis] - ray.o[axis]) * ray.dRcp[axis];
+            float t1 = (bbox.max[axis] - ray.o[axis]) * ray.dRcp[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            near_t = std::max(near_t, t0);
+            far_t = std::min(far_t, t1 * BOX_FAR_SCALE);
+        }
+        return near_t <= far_t;
+    }
     static void subdivideBBox(const BoundingBox3f& parent, BoundingBox3f* bboxes);
+    Node* buildBVHRecursive(BVHPrimitive* primitives, BVHPrimitive* scratch, uint32_t num_primitives,
+            uint32_t recursion_depth, uint32_t max_leaf_size);
+    Node* buildSBVHRecursive(std::vector<BVHPrimitive>& primitives, uint32_t recursion_depth, float root_area,
+            uint32_t split_budget);
+    /// Binned SAH partition of the primitives by their centroids
+    BVHSplit findObjectSplit(const BVHPrimitive* primitives, uint32_t num_primitives, const BoundingBox3f& centroid_bbox,
+            bool parallel) const;
+    /// Binned SAH split plane through the triangles
+    BVHSplit findSpatialSplit(const BVHPrimitive* primitives, uint32_t num_primitives, const BoundingBox3f& bbox,
+            bool parallel) const;
+    /// Bounds of the parts of a (clipped) triangle below and above a plane
+    void splitPrimitive(const BVHPrimitive& primitive, int axis, float position, BoundingBox3f& left,
+            BoundingBox3f& right) const;
+    Node* createLeaf(const BoundingBox3f& bbox, const BVHPrimitive* primitives, uint32_t num_primitives);
 
-    Mesh*         m_meshes[MAX_NUM_MESHES]; ///< Meshes (up to MAX_NUM_MESHES meshes)
+    std::vector<Mesh*> m_meshes;    ///< Unique meshes
+    std::unordered_map<const Mesh*, uint32_t> m_mesh_indices; ///< Index of every mesh in m_meshes
+    std::vector<std::vector<uint32_t>> m_groups; ///< Meshes of every bottom level hierarchy
+    std::unordered_map<const Mesh*, uint32_t> m_mesh_groups; ///< Group of every transformed mesh
+    uint32_t m_static_group = (uint32_t) -1; ///< Group of the meshes placed without a transformation
+    std::vector<InstanceData> m_instances;
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
-    Node*         m_root = nullptr; ///< Root node of Octree
-    uint32_t      m_num_meshes = 0; ///< number of meshes in accel
+    EType         m_type;           ///< Hierarchy type of the bottom levels
+    bool          m_simd;           ///< Use SIMD kernels if available?
+    ENodeFormat   m_node_format;    ///< Storage format of the nodes
+    ESIMDLevel    m_simd_level = ESIMDNone; ///< Kernels used for traversal
+    std::string   m_cache_file;     ///< Cache of the built hierarchies, disabled if empty
+    float         m_split_budget = 0.3f; ///< Additional references allowed for spatial splits, relative to the triangle count
+    bool          m_watertight = false; ///< Use the watertight ray-triangle test?
+    bool          m_collect_statistics = false; ///< Count the work of the single ray queries?
+    mutable tbb::enumerable_thread_specific<TraversalStatistics> m_statistics;
+
+    /// Flattened hierarchies, the root of the top level is stored at index 0
+    std::vector<LinearNode, tbb::cache_aligned_allocator<LinearNode>> m_nodes;
+    /// Quantized copies of m_nodes, which is released when one of them is used
+    std::vector<QuantizedNode<uint16_t>, tbb::cache_aligned_allocator<QuantizedNode<uint16_t>>> m_nodes16;
+    std::vector<QuantizedNode<uint8_t>, tbb::cache_aligned_allocator<QuantizedNode<uint8_t>>> m_nodes8;
+    /// Root node of the bottom level hierarchy of every group
+    std::vector<uint32_t> m_group_roots;
+    /// Full precision boxes of the roots, quantized nodes are decoded relative to them
+    BoundingBox3f m_top_level_bbox;
+    std::vector<BoundingBox3f> m_group_bboxes;
+    /// Triangle and mesh indices referenced by the leaves of the bottom levels
+    std::vector<uint32_t> m_triangle_refs;
+    std::vector<uint32_t> m_mesh_refs;
+    /// Instance indices referenced by the leaves of the top level
+    std::vector<uint32_t> m_instance_refs;
+    /// Precomputed leaf triangles, packet i holds references [i * SIMD_PACKET_SIZE, (i + 1) * SIMD_PACKET_SIZE)
+    std::vector<TrianglePacket, tbb::cache_aligned_allocator<TrianglePacket>> m_triangle_packets;
 
     // only statistics
     uint32_t m_num_nonempty_leaf_nodes = 0;
@@ -105,6 +679,9 @@ private:
     uint32_t m_num_nodes = 0;
     uint32_t m_recursion_depth = 0;
     uint32_t m_num_triangles_saved = 0;
+    float m_sah_cost = 0.f;
+    float m_build_sah_cost = 0.f;   ///< SAH cost right after the last build, the reference of refit()
+    float m_build_time = 0.f;       ///< Duration of the last build in milliseconds
 };
 
 NORI_NAMESPACE_END
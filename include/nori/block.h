@@ -25,8 +25,13 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define NORI_PACKET_SIZE 4 /* Camera rays of 4x4 pixels are traced as one packet */
+#define NORI_MIN_ERROR_LUMINANCE 1e-3f /* Luminance below which pixel errors are absolute, see ImageBlock::getRelativeError() */
 
 NORI_NAMESPACE_BEGIN
 
@@ -86,7 +91,40 @@ public:
     void fromBitmap(const Bitmap &bitmap);
 
     /// Clear all contents
-    void clear() { setConstant(Color4f()); }
+    void clear();
+
+    /**
+     * \brief Additionally record the number of samples in every pixel
+     * and the first two moments of their luminance
+     *
+     * This is required by \ref getRelativeError(). Merged blocks only
+     * contribute moments if they record them as well.
+     */
+    void trackVariance();
+
+    /// Return whether the block records the sample moments, see \ref trackVariance()
+    bool tracksVariance() const { return m_moments.size() > 0; }
+
+    /// Return the number of samples that fell into a pixel, requires \ref trackVariance()
+    float getSampleCount(const Point2i &pixel) const { return (float) m_moments(momentIndex(pixel), 0); }
+
+    /**
+     * \brief Estimate the relative standard error of the luminance of a pixel,
+     * requires \ref trackVariance()
+     *
+     * Only the samples that fell into pixels are considered, regardless of
+     * the reconstruction filter. Pixels that are almost black are measured
+     * against a luminance of \c NORI_MIN_ERROR_LUMINANCE.
+     *
+     * A \c radius above zero estimates the mean and variance from the
+     * samples of all pixels at most that far away instead. Adaptive
+     * sampling needs this: when the sample counts follow the error
+     * estimate of the pixel alone, pixels that happened to draw low
+     * variance samples keep them, which biases the image.
+     *
+     * \return Infinity for pixels with fewer than two samples
+     */
+    float getRelativeError(const Point2i &pixel, int radius = 0) const;
 
     /// Record a sample with the given position and radiance value
     void put(const Point2f &pos, const Color3f &value);
@@ -94,20 +132,50 @@ public:
     /**
      * \brief Merge another image block into this one
      *
-     * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * This function is thread-safe without locking, provided that the
+     * blocks merged at the same time do not overlap apart from their
+     * borders (as is the case for the blocks of a \ref BlockGenerator).
+     * Only the pixels that the borders of neighbouring blocks reach
+     * are shared, they are accumulated atomically in a separate buffer
+     * and added to the image by \ref toBitmap(). Sample moments only
+     * belong to the pixels of a block itself and are added directly.
      */
     void put(ImageBlock &b);
 
-    /// Lock the image block (using an internal mutex)
+    /**
+     * \brief Keep a copy of the merged image that can be read while
+     * other threads merge blocks into it
+     *
+     * \ref put(ImageBlock &) then copies the pixels it changed into the
+     * preview while holding the lock of \ref lock().
+     */
+    void enablePreview();
+
+    /**
+     * \brief Return the copy of \ref enablePreview(), or the block itself
+     * when no preview is kept. Call \ref lock() while reading it.
+     */
+    const Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> &getPreview() const {
+        return m_preview.size() > 0 ? m_preview : *this;
+    }
+
+    /// Lock the preview against updates by \ref put(ImageBlock &) (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
-    
-    /// Unlock the image block
+
+    /// Unlock the preview
     inline void unlock() const { m_mutex.unlock(); }
 
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /// Index of a pixel (not counting the border) in \ref m_moments
+    Eigen::Index momentIndex(const Point2i &pixel) const {
+        return (Eigen::Index) pixel.y() * (cols() - 2 * m_borderSize) + pixel.x();
+    }
+
+    /// Return the stored value of a pixel, including its share in \ref m_shared
+    Color4f getPixel(Eigen::Index y, Eigen::Index x) const;
+
     Point2i m_offset;
     Vector2i m_size;
     int m_borderSize = 0;
@@ -116,6 +184,16 @@ protected:
     float *m_weightsX = nullptr;
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
+    /**
+     * Sample count, luminance sum and sum of squared luminances of every pixel, see
+     * \ref trackVariance(). Double precision keeps the variance of long renders exact.
+     */
+    Eigen::Array<double, Eigen::Dynamic, 3, Eigen::RowMajor> m_moments;
+    /// Contributions of merged blocks to pixels that other blocks reach as well (4 per pixel), see \ref put(ImageBlock &)
+    std::unique_ptr<std::atomic<float>[]> m_shared;
+    std::once_flag m_sharedAllocated;
+    /// Copy of the image for readers running concurrently with the merges, see \ref enablePreview()
+    Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> m_preview;
     mutable tbb::mutex m_mutex;
 };
 
@@ -123,21 +201,31 @@ protected:
  * \brief Spiraling block generator
  *
  * This class can be used to chop up an image into many small
- * rectangular blocks suitable for parallel rendering. The blocks
- * are ordered in spiraling pattern so that the center is
- * rendered first.
+ * rectangular blocks suitable for parallel rendering. By default, the
+ * blocks are ordered in spiraling pattern so that the center is
+ * rendered first. The order is computed once at construction, handing
+ * out a block only takes an atomic increment.
  */
 class BlockGenerator {
 public:
+    /// Order in which the blocks are handed out
+    enum EOrder {
+        ESpiral = 0, ///< Spiral starting at the center of the image
+        EHilbert,    ///< Hilbert curve, neighbouring blocks are rendered close in time
+        EScanline    ///< Row by row, starting at the top left
+    };
+
     /**
      * \brief Create a block generator with
      * \param size
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param order
+     *      Order in which the blocks are handed out
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
-    
+    BlockGenerator(const Vector2i &size, int blockSize, EOrder order = ESpiral);
+
     /**
      * \brief Return the next block to be rendered
      *
@@ -147,20 +235,38 @@ public:
      */
     bool next(ImageBlock &block);
 
+    /**
+     * \brief Hand out the blocks with the highest cost first
+     *
+     * Expensive blocks started late keep a few threads busy while the
+     * others are idle already. The blocks are identified by their index
+     * in scanline order (see \ref getBlockIndex()), blocks of equal cost
+     * keep their current order. This also restarts the generator, it
+     * must not be called while other threads request blocks.
+     */
+    void sortByCost(const std::vector<float> &cost);
+
+    /// Hand out all blocks again, must not be called while other threads request blocks
+    void reset() { m_next = 0; }
+
+    /// Return the index of a block in scanline order, e.g. to record its cost
+    int getBlockIndex(const ImageBlock &block) const {
+        return block.getOffset().y() / m_blockSize * m_numBlocks.x() + block.getOffset().x() / m_blockSize;
+    }
+
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Parse the name of a block order (spiral, hilbert or scanline)
+    static EOrder parseOrder(const std::string &name);
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
     Vector2i m_numBlocks;
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    std::vector<Point2i> m_blocks; ///< Block coordinates in the order they are handed out
+    std::atomic<int> m_next;       ///< Index of the next block in \ref m_blocks
 };
 
 NORI_NAMESPACE_END
@@ -57,6 +57,25 @@ public:
         const Point2f &samplePosition,
         const Point2f &apertureSample) const = 0;
 
+    /**
+     * \brief Importance sample a packet of rays, e.g. for neighbouring
+     * pixels that are traced together
+     *
+     * The default implementation calls \ref sampleRay() for every ray.
+     *
+     * \param weights
+     *    Receives the importance weight of every ray
+     *
+     * \param count
+     *    Number of rays, sample positions and aperture samples
+     */
+    virtual void sampleRayPacket(Ray3f *rays, Color3f *weights,
+        const Point2f *samplePositions,
+        const Point2f *apertureSamples, uint32_t count) const {
+        for (uint32_t i = 0; i < count; ++i)
+            weights[i] = sampleRay(rays[i], samplePositions[i], apertureSamples[i]);
+    }
+
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
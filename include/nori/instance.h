@@ -0,0 +1,58 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Transformed copy of a triangle mesh
+ *
+ * The mesh is either declared inside the instance or referenced with
+ * <tt>&lt;ref id="..."/&gt;</tt>. All instances of a mesh share its
+ * geometry and its hierarchy in the acceleration data structure.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &props);
+
+    /// Register the instanced mesh
+    void addChild(NoriObject *obj);
+
+    /// Check that a mesh was specified
+    void activate();
+
+    /// Return the instanced mesh
+    Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the object-to-world transformation
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Return a human-readable summary
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+protected:
+    Mesh *m_mesh = nullptr;
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
@@ -53,6 +53,26 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose first
+     * intersection has already been computed
+     *
+     * If \ref usesRayPackets() returns \c true, the renderer traces camera
+     * rays in packets (see \ref Scene::rayIntersectPacket()) and calls this
+     * function instead of \ref Li(). The default implementation ignores
+     * the intersection and calls \ref Li().
+     *
+     * \param its
+     *    The first intersection along the ray, or \c nullptr if the
+     *    ray leaves the scene
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Does this integrator implement \ref LiPrimary()?
+    virtual bool usesRayPackets() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -64,6 +64,71 @@ struct Intersection {
     std::string toString() const;
 };
 
+/**
+ * \brief Column-major matrix of mesh data that either owns its storage or
+ * refers to memory that is owned elsewhere (e.g. a memory-mapped file)
+ *
+ * Behaves like the corresponding Eigen matrix. \ref resize() and assignments
+ * always switch to storage owned by the matrix, while \ref map() refers to
+ * existing memory without copying it. The caller of \ref map() has to keep
+ * that memory alive for as long as the matrix refers to it.
+ */
+template <typename Scalar> class MeshMatrix
+        : public Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> {
+public:
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+    typedef Eigen::Map<Matrix> Base;
+
+    /// Create an empty matrix
+    MeshMatrix() : Base(nullptr, 0, 0) { }
+
+    /// Copy the contents of another matrix, even if it only maps them
+    MeshMatrix(const MeshMatrix &other) : Base(nullptr, 0, 0) { assign(other); }
+
+    MeshMatrix &operator=(const MeshMatrix &other) { assign(other); return *this; }
+
+    template <typename Derived> MeshMatrix &operator=(const Eigen::MatrixBase<Derived> &other) {
+        assign(other);
+        return *this;
+    }
+
+    /// Switch to owned storage of the given size, the contents are undefined
+    void resize(Eigen::Index rows, Eigen::Index cols) {
+        if (isMapped() || m_storage.rows() != rows || m_storage.cols() != cols) {
+            m_storage.resize(rows, cols);
+            rebind(m_storage.data(), rows, cols);
+        }
+    }
+
+    /// Refer to \c rows x \c cols values at \c data (column-major) without copying them
+    void map(Scalar *data, Eigen::Index rows, Eigen::Index cols) {
+        m_storage.resize(0, 0);
+        rebind(data, rows, cols);
+    }
+
+    /// Does the matrix refer to memory that it does not own?
+    bool isMapped() const { return this->size() > 0 && this->data() != m_storage.data(); }
+
+private:
+    template <typename Derived> void assign(const Eigen::MatrixBase<Derived> &other) {
+        /* Evaluate first, \c other may refer to the current contents */
+        Matrix result = other;
+        m_storage.swap(result);
+        rebind(m_storage.data(), m_storage.rows(), m_storage.cols());
+    }
+
+    void rebind(Scalar *data, Eigen::Index rows, Eigen::Index cols) {
+        /* Changing the mapped array is done by constructing the map anew */
+        new (static_cast<Base *>(this)) Base(data, rows, cols);
+    }
+
+    Matrix m_storage;
+};
+
+typedef MeshMatrix<float>    MeshMatrixXf;
+typedef MeshMatrix<uint32_t> MeshMatrixXu;
+typedef MeshMatrix<uint16_t> MeshMatrixXs;
+
 /**
  * \brief Triangle mesh
  *
@@ -71,6 +136,14 @@ struct Intersection {
  * for querying the individual triangles. Subclasses of \c Mesh implement
  * the specifics of how to create its contents (e.g. by loading from an
  * external file)
+ *
+ * Meshes with the property \c compact store their vertex data in less
+ * memory once they are activated: normals are octahedral-encoded in 32
+ * bits, texture coordinates are quantized to 16 bits over their range
+ * and meshes with at most 65536 vertices use 16 bit indices. The
+ * positions stay exact. Code that should work with both representations
+ * accesses the data through \ref getVertexIndex(), \ref getVertexNormal()
+ * and \ref getVertexTexCoord(), which decode it on the fly.
  */
 class Mesh : public NoriObject {
 public:
@@ -81,7 +154,7 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this shape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const { return (uint32_t) (m_F16.size() > 0 ? m_F16.cols() : m_F.cols()); }
 
     /// Return the total number of vertices in this shape
     uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
@@ -126,16 +199,59 @@ public:
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MeshMatrixXf &getVertexPositions() const { return m_V; }
+
+    /**
+     * \brief Replace the vertex positions, e.g. by the next frame of an animation
+     *
+     * The number of vertices and the triangles stay the same. The vertex
+     * normals are replaced as well when given and discarded otherwise.
+     * Acceleration data structures containing the mesh have to be
+     * updated afterwards, see \ref Accel::refit().
+     */
+    void setVertexPositions(const MatrixXf &positions, const MatrixXf &normals = MatrixXf());
+
+    /// Return a pointer to the vertex normals (empty if there are none or the mesh is compact)
+    const MeshMatrixXf &getVertexNormals() const { return m_N; }
+
+    /// Return a pointer to the texture coordinates (empty if there are none or the mesh is compact)
+    const MeshMatrixXf &getVertexTexCoords() const { return m_UV; }
+
+    /// Return a pointer to the triangle vertex index list (empty if the mesh uses 16 bit indices)
+    const MeshMatrixXu &getIndices() const { return m_F; }
+
+    /// Return a pointer to the 16 bit triangle vertex index list of a compact mesh (or an empty matrix)
+    const MeshMatrixXs &getCompactIndices() const { return m_F16; }
+
+    /// Return the vertex index of the given corner (0, 1 or 2) of a triangle
+    uint32_t getVertexIndex(uint32_t triangle, int corner) const {
+        return m_F16.size() > 0 ? (uint32_t) m_F16(corner, triangle) : m_F(corner, triangle);
+    }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    /// Does the mesh have vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || !m_compactN.empty(); }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    /// Return the normal of the given vertex
+    Normal3f getVertexNormal(uint32_t index) const {
+        return m_compactN.empty() ? Normal3f(m_N.col(index)) : decodeNormal(m_compactN[index]);
+    }
+
+    /// Does the mesh have texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || m_compactUV.size() > 0; }
+
+    /// Return the texture coordinates of the given vertex
+    Point2f getVertexTexCoord(uint32_t index) const {
+        if (m_compactUV.size() == 0)
+            return m_UV.col(index);
+        return m_uvOffset + m_uvScale.cwiseProduct(
+            Point2f((float) m_compactUV(0, index), (float) m_compactUV(1, index)));
+    }
+
+    /// Does the mesh store its vertex data in the compact representation?
+    bool isCompact() const { return m_compact; }
 
-    /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    /// Return the memory used by the vertex data and indices in bytes
+    size_t getMemoryUsage() const;
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -179,16 +295,48 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Convert the vertex data to the compact representation (called by \ref activate())
+    void compact();
+
+    /// Encode a unit vector in 2x16 bits with the octahedral mapping
+    static uint32_t encodeNormal(const Normal3f &n);
+
+    /// Decode a normal encoded by \ref encodeNormal()
+    static Normal3f decodeNormal(uint32_t value) {
+        float x = (float) (int16_t) (value & 0xffff) / 32767.f;
+        float y = (float) (int16_t) (value >> 16) / 32767.f;
+        float z = 1.f - std::abs(x) - std::abs(y);
+        /* Unfold the lower hemisphere */
+        float t = std::max(-z, 0.f);
+        x += x >= 0.f ? -t : t;
+        y += y >= 0.f ? -t : t;
+        return Normal3f(x, y, z).normalized();
+    }
+
 protected:
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    MeshMatrixXf  m_V;                   ///< Vertex positions
+    MeshMatrixXf  m_N;                   ///< Vertex normals
+    MeshMatrixXf  m_UV;                  ///< Vertex texture coordinates
+    MeshMatrixXu  m_F;                   ///< Faces
+    bool          m_compact = false;     ///< Convert to the compact representation on activation?
+    std::vector<uint32_t> m_compactN;    ///< Octahedral-encoded vertex normals of a compact mesh
+    MeshMatrixXs  m_compactUV;           ///< Quantized texture coordinates of a compact mesh
+    Point2f       m_uvOffset;            ///< Texture coordinates of the quantized value 0
+    Point2f       m_uvScale;             ///< Texture coordinate difference of one quantization step
+    MeshMatrixXs  m_F16;                 ///< Faces of a compact mesh with at most 65536 vertices
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     DiscretePDF m_dpdf;                  ///< Discrete PDF to sample mesh surface, only for emitter
 };
 
+/**
+ * \brief Write a mesh in the binary format of the \c nmesh plugin
+ *
+ * The \c nmesh plugin maps such a file into memory instead of parsing
+ * it (see src/nmesh.cpp). Throws a \ref NoriException on failure.
+ */
+extern void saveBinaryMesh(const Mesh *mesh, const std::string &filename);
+
 NORI_NAMESPACE_END
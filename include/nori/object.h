@@ -42,6 +42,7 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EInstance,
         EClassTypeCount
     };
 
@@ -98,6 +99,7 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EInstance:   return "instance";
             default:          return "<unknown>";
         }
     }
@@ -141,9 +143,11 @@ public:
      */
     static NoriObject *createInstance(const std::string &name,
             const PropertyList &propList) {
-        if (!m_constructors || m_constructors->find(name) == m_constructors->end())
+        /* Only reads the registry, the parser creates meshes from several threads */
+        auto it = m_constructors ? m_constructors->find(name) : std::map<std::string, Constructor>::iterator();
+        if (!m_constructors || it == m_constructors->end())
             throw NoriException("A constructor for class \"%s\" could not be found!", name);
-        return (*m_constructors)[name](propList);
+        return it->second(propList);
     }
 private:
     static std::map<std::string, Constructor> *m_constructors;
@@ -22,10 +22,34 @@
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Property that is set on every object with a certain tag
+ * of a scene file, see \ref loadFromXML()
+ *
+ * This runs the same scene with different settings, e.g. another
+ * acceleration data structure, without a copy of the file.
+ */
+struct PropertyOverride {
+    /// Parse an override of the form "tag.name=value", e.g. "scene.accel=sbvh"
+    PropertyOverride(const std::string &str);
+
+    /// Tag of the objects, e.g. "scene" or "mesh"
+    std::string tag;
+    /// Name of the property
+    std::string name;
+    /// Value of the property, as it would be written in the XML file
+    std::string value;
+};
+
 /**
  * \brief Load a scene from the specified filename and
  * return its root object
+ *
+ * The \c overrides replace the values of existing properties. Missing
+ * properties are added as booleans for "true" and "false", as integers
+ * or floats for numbers and as strings otherwise.
  */
-extern NoriObject *loadFromXML(const std::string &filename);
+extern NoriObject *loadFromXML(const std::string &filename,
+                               const std::vector<PropertyOverride> &overrides = {});
 
 NORI_NAMESPACE_END
@@ -0,0 +1,70 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Settings of the block renderer
+ *
+ * A single instance exists (see \ref getRenderSettings()), which the
+ * command line options of nori configure before the scene is loaded.
+ */
+struct RenderSettings {
+    /// Order in which the blocks are rendered
+    BlockGenerator::EOrder blockOrder = BlockGenerator::ESpiral;
+    /// Samples per pixel, zero for the count of the sampler of the scene
+    uint32_t targetSampleCount = 0;
+    /// Render in passes over all blocks, see \ref renderImage()
+    bool progressive = false;
+    /// Samples per pixel of every progressive pass
+    uint32_t passSampleCount = 1;
+    /// Seconds a progressive render may take, zero for no limit
+    double timeBudget = 0;
+    /// Relative error of all pixels that ends a progressive render, zero for none
+    float noiseThreshold = 0;
+    /// Distribute the samples of progressive passes by pixel error
+    bool adaptive = false;
+    /// Print the progress of single pass renders in steps of 10 percent
+    bool reportProgress = false;
+};
+
+/// Return the settings of the block renderer
+extern RenderSettings *getRenderSettings();
+
+/**
+ * \brief Render the image of a scene with the settings of
+ * \ref getRenderSettings()
+ *
+ * The image is split into blocks (see \ref BlockGenerator), which are
+ * rendered in parallel and merged into \c result. This must have the
+ * output size and reconstruction filter of the camera and be cleared.
+ *
+ * Progressive renders take the samples in passes over all blocks, so
+ * that \c result is a complete image after every pass. They stop once
+ * the target number of samples is taken, when the time budget is used
+ * up or when no pixel is above the noise threshold anymore. Adaptive
+ * renders distribute the samples of later passes by the error of the
+ * pixels.
+ */
+extern void renderImage(const Scene *scene, ImageBlock &result);
+
+NORI_NAMESPACE_END
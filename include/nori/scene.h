@@ -37,9 +37,12 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
+    /// Return a pointer to the scene's acceleration data structure
+    Accel *getAccel() { return m_accel; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -75,7 +78,27 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_accel->rayIntersect(ray, its, false);
+        return m_accel->rayIntersect(ray, its);
+    }
+
+    /**
+     * \brief Intersect a ray against all triangles stored in the scene
+     * and only return which triangle was hit and where along the ray
+     *
+     * Integrators that decide based on the mesh of the hit (e.g. whether
+     * it is an emitter) or terminate the path afterwards call this method
+     * and compute the detailed intersection record with
+     * \ref computeSurfaceInteraction() only when they need it.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, Accel::HitRecord &hit) const {
+        return m_accel->rayIntersect(ray, hit);
+    }
+
+    /// Fill the detailed intersection record of a hit found by \ref rayIntersect()
+    void computeSurfaceInteraction(const Accel::HitRecord &hit, Intersection &its) const {
+        m_accel->computeSurfaceInteraction(hit, its);
     }
 
     /**
@@ -94,8 +117,32 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a packet of coherent rays (e.g. camera rays of
+     * neighbouring pixels) against all triangles stored in the scene
+     *
+     * \param rays
+     *    Array of \c count rays, at most \ref MAX_RAY_PACKET_SIZE
+     *
+     * \param its
+     *    Array of \c count intersection records, only the records of
+     *    rays with an intersection are filled
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const {
+        return m_accel->rayIntersectPacket(rays, its, count);
+    }
+
+    /**
+     * \brief Shadow ray version of \ref rayIntersectPacket(), only determines
+     * which rays are blocked
+     */
+    uint32_t rayIntersectPacket(const Ray3f *rays, uint32_t count) const {
+        return m_accel->occludedPacket(rays, count);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -103,10 +150,21 @@ public:
         return m_accel->getBoundingBox();
     }
 
+    /**
+     * \brief Update the acceleration data structure after vertex positions
+     * were changed with \ref Mesh::setVertexPositions()
+     *
+     * Refits the existing hierarchy and only rebuilds it when its quality
+     * degraded too much or it cannot be refitted, see \ref Accel::refit()
+     *
+     * \return \c true if the hierarchy had to be rebuilt
+     */
+    bool refit() { return m_accel->refit(); }
+
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
-     * Initializes the internal data structures (kd-tree,
+     * Initializes the internal data structures (acceleration data structure,
      * emitter sampling data structures, etc.)
      */
     void activate();
@@ -121,6 +179,7 @@ public:
 private:
     std::vector<Mesh *> m_meshes;
     std::vector<Mesh *> m_emitter;
+    std::vector<Instance *> m_instances;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
@@ -3,15 +3,50 @@ import os
 import subprocess
 import sys
 
+# Scenes are given as a path, or as a path together with command line arguments of
+# nori and optionally a message that it has to print. The reference scenes are also
+# run with other settings via "--property".
 TEST_SCENES = [
     "pa4/tests/test-mesh.xml",
     "pa4/tests/test-mesh-furnace.xml",
+    ("pa4/tests/test-mesh.xml", ["--property", "scene.accel=octree"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.accel=octree"]),
+    ("pa4/tests/test-mesh.xml", ["--property", "scene.nodes=quantized16"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.nodes=quantized16"]),
+    ("pa4/tests/test-mesh.xml", ["--property", "scene.nodes=quantized8"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.nodes=quantized8"]),
+    ("pa4/tests/test-mesh.xml", ["--property", "scene.accel=sbvh"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.accel=sbvh"]),
+    ("pa4/tests/test-mesh.xml", ["--property", "scene.watertight=true"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.watertight=true"]),
+    "pa4/tests/test-watertight.xml",
+    "pa4/tests/test-obj.xml",
+    "pa4/tests/test-instance.xml",
+    "pa4/tests/test-heatmap.xml",
+    "pa4/tests/test-nmesh.xml",
+    ("pa4/tests/test-mesh.xml", ["--property", "mesh.compact=true"]),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "mesh.compact=true"]),
+    # The second scene of each run loads the cache of the first one, the next
+    # run loads it as well. The SBVH does not match it and has to rebuild it.
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.cache=test-mesh-furnace.cache"], "loaded from cache"),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.cache=test-mesh-furnace.cache"], "loaded from cache"),
+    ("pa4/tests/test-mesh-furnace.xml", ["--property", "scene.cache=test-mesh-furnace.cache", "--property", "scene.accel=sbvh"], "is outdated, rebuilding"),
+    "pa4/tests/test-refit.xml",
+    ("pa4/tests/test-progressive.xml", ["--progressive", "--spp", "16"]),
+    ("pa4/tests/test-progressive.xml", ["--adaptive", "--spp", "16"]),
     "pa5/tests/chi2test-microfacet.xml",
     "pa5/tests/ttest-microfacet.xml",
     "pa5/tests/test-direct.xml",
     "pa5/tests/test-furnace.xml",
 ]
 
+# Meshes that nori-convert turns into the binary mesh format before the scenes are run
+TEST_MESHES = [
+    "pa4/tests/meshes/floor-normals.obj",
+    "pa4/tests/meshes/polylum1.obj",
+    "pa4/tests/meshes/polylum2.obj",
+]
+
 TEST_WARPS = [
     ("square", None),
     ("tent", None),
@@ -40,15 +75,35 @@ def find_build_directory():
     return os.path.join(root, "build")
 
 
-def test_warps_and_scenes(scenes, warps):
-    total = len(scenes) + len(warps)
+def test_warps_and_scenes(scenes, warps, meshes=[]):
+    total = len(meshes) + len(scenes) + len(warps)
     passed = 0
     failed = []
     build_dir = find_build_directory()
 
+    for m in meshes:
+        path = os.path.join("scenes", m)
+        ret = subprocess.call([os.path.join(build_dir, "nori-convert"), path])
+        if ret == 0:
+            passed += 1
+        else:
+            failed.append("nori-convert " + m)
+
     for t in scenes:
-        path = os.path.join("scenes", t)
-        ret = subprocess.call([os.path.join(build_dir, "nori"), path])
+        # Scenes may be given together with command line arguments of nori,
+        # and with a message that nori has to print
+        if not isinstance(t, tuple):
+            t = (t, [])
+        scene, extra, expected = t[0], t[1], t[2] if len(t) > 2 else None
+        path = os.path.join("scenes", scene)
+        process = subprocess.Popen([os.path.join(build_dir, "nori"), path] + extra,
+                                   stdout=subprocess.PIPE, universal_newlines=True)
+        output = process.communicate()[0]
+        print(output, end="")
+        ret = process.returncode
+        if ret == 0 and expected is not None and expected not in output:
+            print("Expected the output \"" + expected + "\"")
+            ret = 1
         if ret == 0:
             passed += 1
         else:
@@ -83,5 +138,5 @@ def test_warps_and_scenes(scenes, warps):
 
 
 if __name__ == '__main__':
-    if not test_warps_and_scenes(TEST_SCENES, TEST_WARPS):
+    if not test_warps_and_scenes(TEST_SCENES, TEST_WARPS, TEST_MESHES):
         sys.exit(1)
@@ -0,0 +1,69 @@
+#!python
+
+import math
+import sys
+
+# Make up a closed mesh for the watertight test: a UV sphere around the
+# origin whose triangles face inwards and share their vertices. The sphere
+# is rotated, so that its edges are not aligned with the coordinate axes.
+
+rings, segments = 16, 64
+angle_x, angle_y = 0.3, 0.7
+
+def rotate(v):
+    x, y, z = v
+    y, z = y * math.cos(angle_x) - z * math.sin(angle_x), y * math.sin(angle_x) + z * math.cos(angle_x)
+    x, z = x * math.cos(angle_y) + z * math.sin(angle_y), -x * math.sin(angle_y) + z * math.cos(angle_y)
+    return (x, y, z)
+
+# Step 1: the vertices, from the north to the south pole
+
+vertices = [(0.0, 0.0, 1.0)]
+for k in range(1, rings):
+    theta = math.pi * k / rings
+    for j in range(segments):
+        phi = 2 * math.pi * j / segments
+        vertices.append((math.sin(theta) * math.cos(phi), math.sin(theta) * math.sin(phi), math.cos(theta)))
+vertices.append((0.0, 0.0, -1.0))
+vertices = [rotate(v) for v in vertices]
+
+# Step 2: the triangles, oriented so that their normals point to the origin
+
+def ring_vertex(k, j):
+    return 2 + (k - 1) * segments + j % segments
+
+faces = []
+for j in range(segments):
+    faces.append((1, ring_vertex(1, j), ring_vertex(1, j + 1)))
+for k in range(1, rings - 1):
+    for j in range(segments):
+        a, b = ring_vertex(k, j), ring_vertex(k, j + 1)
+        c, d = ring_vertex(k + 1, j), ring_vertex(k + 1, j + 1)
+        faces += [(a, c, d), (a, d, b)]
+for j in range(segments):
+    faces.append((len(vertices), ring_vertex(rings - 1, j + 1), ring_vertex(rings - 1, j)))
+
+def sub(a, b):
+    return [a[i] - b[i] for i in range(3)]
+
+def cross(a, b):
+    return (a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0])
+
+for i, f in enumerate(faces):
+    p = [vertices[k - 1] for k in f]
+    normal = cross(sub(p[1], p[0]), sub(p[2], p[0]))
+    if sum(normal[k] * p[0][k] for k in range(3)) > 0:
+        faces[i] = (f[0], f[2], f[1])
+
+# Step 3: write out the mesh
+
+if len(sys.argv) < 2:
+    print("Usage: python sphere.py <obj output file>")
+    sys.exit(-1)
+
+f_obj = open(sys.argv[1], 'w')
+for v in vertices:
+    f_obj.write("v %f %f %f\n" % v)
+for f in faces:
+    f_obj.write("f %d %d %d\n" % f)
+f_obj.close()
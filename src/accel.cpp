@@ -18,38 +18,325 @@
 
 #include <nori/accel.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
 #include <chrono>
 
 using namespace std::chrono;
 
 NORI_NAMESPACE_BEGIN
 
-void Accel::addMesh(Mesh *mesh) {
-    if (m_num_meshes >= MAX_NUM_MESHES)
-        throw NoriException("Accel: only %d meshes are supported!", MAX_NUM_MESHES);
-    m_meshes[m_num_meshes] = mesh;
-    m_bbox.expandBy(mesh->getBoundingBox());
-    m_num_meshes++;
+struct Accel::BVHPrimitive {
+    BoundingBox3f bbox;
+    Point3f centroid;
+    uint32_t triangle_idx; ///< Instance index in the top level
+    uint32_t mesh_idx;
+};
+
+/// Bounds of a range of BVH primitives and of their centroids
+struct BVHBounds {
+    BoundingBox3f bbox;
+    BoundingBox3f centroid_bbox;
+
+    static BVHBounds merge(BVHBounds a, const BVHBounds& b) {
+        a.bbox.expandBy(b.bbox);
+        a.centroid_bbox.expandBy(b.centroid_bbox);
+        return a;
+    }
+};
+
+/// Per-axis SAH bins of a range of BVH primitives
+struct BVHBins {
+    BoundingBox3f bboxes[3][BVH_NUM_BINS];
+    uint32_t counts[3][BVH_NUM_BINS] = {};
+
+    static BVHBins merge(BVHBins a, const BVHBins& b) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (uint32_t i = 0; i < BVH_NUM_BINS; i++) {
+                a.bboxes[axis][i].expandBy(b.bboxes[axis][i]);
+                a.counts[axis][i] += b.counts[axis][i];
+            }
+        }
+        return a;
+    }
+};
+
+/// Per-axis bins of the spatial splits, triangles are clipped into every bin they overlap
+struct SpatialBins {
+    BoundingBox3f bboxes[3][BVH_NUM_BINS];
+    uint32_t entry_counts[3][BVH_NUM_BINS] = {};
+    uint32_t exit_counts[3][BVH_NUM_BINS] = {};
+
+    static SpatialBins merge(SpatialBins a, const SpatialBins& b) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (uint32_t i = 0; i < BVH_NUM_BINS; i++) {
+                a.bboxes[axis][i].expandBy(b.bboxes[axis][i]);
+                a.entry_counts[axis][i] += b.entry_counts[axis][i];
+                a.exit_counts[axis][i] += b.exit_counts[axis][i];
+            }
+        }
+        return a;
+    }
+};
+
+/// Best SAH split of a BVH node
+struct Accel::BVHSplit {
+    int axis = -1;          ///< -1 if no split was found
+    bool spatial = false;   ///< Split plane through the triangles (SBVH) instead of a partition of the primitives
+    float cost = std::numeric_limits<float>::infinity(); ///< SAH cost of the children, not normalized
+    BoundingBox3f left_bbox, right_bbox;
+    uint32_t left_count = 0, right_count = 0;
+
+    // object splits put primitives whose centroid falls into a bin below \c bin to the left
+    uint32_t bin = 0;
+    float bin_min = 0.f, bin_factor = 0.f;
+
+    float position = 0.f;   ///< Position of the plane of spatial splits
+
+    /// Bin of a centroid coordinate along the split axis
+    uint32_t binIndex(float value) const {
+        return std::min((uint32_t) ((value - bin_min) * bin_factor), BVH_NUM_BINS - 1);
+    }
+
+    /// Does a primitive go to the left child of an object split?
+    bool isLeft(const BVHPrimitive& primitive) const {
+        return binIndex(primitive.centroid[axis]) < bin;
+    }
+};
+
+void Accel::addInstance(Mesh *mesh, const Transform &toWorld) {
+    // meshes are only stored once, no matter how often they are placed
+    auto it = m_mesh_indices.find(mesh);
+    uint32_t mesh_idx;
+    if (it == m_mesh_indices.end()) {
+        mesh_idx = (uint32_t) m_meshes.size();
+        m_meshes.push_back(mesh);
+        m_mesh_indices[mesh] = mesh_idx;
+    } else {
+        mesh_idx = it->second;
+    }
+
+    InstanceData instance;
+    instance.transformed = !toWorld.getMatrix().isIdentity();
+    instance.to_world = toWorld;
+    instance.to_local = toWorld.inverse();
+
+    if (!instance.transformed) {
+        /* Untransformed meshes share a single hierarchy, overlapping meshes
+           would otherwise all have to be traversed by the same ray */
+        if (m_static_group == (uint32_t) -1) {
+            m_static_group = (uint32_t) m_groups.size();
+            m_groups.emplace_back();
+            instance.group_idx = m_static_group;
+            m_instances.push_back(instance);
+        }
+        std::vector<uint32_t>& group = m_groups[m_static_group];
+        if (std::find(group.begin(), group.end(), mesh_idx) == group.end())
+            group.push_back(mesh_idx);
+        m_bbox.expandBy(mesh->getBoundingBox());
+        return;
+    }
+
+    auto group_it = m_mesh_groups.find(mesh);
+    if (group_it == m_mesh_groups.end()) {
+        instance.group_idx = (uint32_t) m_groups.size();
+        m_groups.push_back(std::vector<uint32_t> { mesh_idx });
+        m_mesh_groups[mesh] = instance.group_idx;
+    } else {
+        instance.group_idx = group_it->second;
+    }
+    m_instances.push_back(instance);
+    m_bbox.expandBy(getInstanceBoundingBox(instance));
+}
+
+BoundingBox3f Accel::getInstanceBoundingBox(const InstanceData& instance) const {
+    BoundingBox3f bbox;
+    for (uint32_t mesh_idx : m_groups[instance.group_idx])
+        bbox.expandBy(m_meshes[mesh_idx]->getBoundingBox());
+    if (!instance.transformed)
+        return bbox;
+
+    BoundingBox3f result;
+    for (int i = 0; i < 8; i++)
+        result.expandBy(instance.to_world * bbox.getCorner(i));
+    return result;
 }
 
 void Accel::build() {
-    if (m_num_meshes == 0)
+    if (m_instances.empty())
         throw NoriException("No mesh found, could not build acceleration structure");
 
     auto start = high_resolution_clock::now();
     // delete old hierarchy if present
-    delete m_root;
+    clear();
+    m_simd_level = m_simd ? detectSIMDLevel() : ESIMDNone;
+
+    uint64_t cache_key = 0;
+    if (!m_cache_file.empty()) {
+        cache_key = computeCacheKey();
+        if (loadCache(cache_key)) {
+            m_build_sah_cost = m_sah_cost;
+            m_build_time = duration<float, std::milli>(high_resolution_clock::now() - start).count();
+            printf("%s loaded from cache \"%s\" in %ldms \n", getTypeName(), m_cache_file.c_str(),
+                   duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
+            printf("Instances: %d (bottom level hierarchies: %d) \n", (int) m_instances.size(), (int) m_groups.size());
+            printf("Num nodes: %d \n", m_num_nodes);
+            printf("SAH cost: %f \n", m_sah_cost);
+            printf("Node memory: %s \n", memString(getMemoryUsage()).c_str());
+            return;
+        }
+    }
+
+    // bottom levels
+    uint32_t num_groups = (uint32_t) m_groups.size();
+    std::vector<Node*> group_roots(num_groups);
+    tbb::parallel_for(0u, num_groups, [&](uint32_t i) {
+        group_roots[i] = buildGroup(m_groups[i]);
+    });
+
+    // top level, a BVH over the instance bounding boxes
+    uint32_t num_instances = (uint32_t) m_instances.size();
+    std::vector<BVHPrimitive> primitives(num_instances);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_instances, PARALLEL_BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            BVHPrimitive& primitive = primitives[i];
+            primitive.triangle_idx = i;
+            primitive.mesh_idx = 0;
+            primitive.bbox = getInstanceBoundingBox(m_instances[i]);
+            primitive.centroid = primitive.bbox.getCenter();
+        }
+    });
+    std::vector<BVHPrimitive> scratch(num_instances);
+    Node* top_root = buildBVHRecursive(primitives.data(), scratch.data(), num_instances, 0, 1);
+    primitives = std::vector<BVHPrimitive>();
+    scratch = std::vector<BVHPrimitive>();
+    auto build_end = high_resolution_clock::now();
 
+    // move the hierarchies into one contiguous array and release the pointer based trees
+    m_nodes.emplace_back();
+    flatten(top_root, 0, 0, true);
+    m_top_level_bbox = top_root->bbox;
+    delete top_root;
+    uint32_t num_top_level_nodes = (uint32_t) m_nodes.size();
+
+    // the reported SAH cost is the average over all groups, weighted by their triangle counts
+    float sah_cost = 0.f;
     uint32_t num_triangles = 0;
-    for (uint32_t mesh_idx = 0; mesh_idx < m_num_meshes; mesh_idx++) {
+    for (uint32_t i = 0; i < num_groups; i++) {
+        uint32_t first_ref = (uint32_t) m_triangle_refs.size();
+        m_group_roots.push_back((uint32_t) m_nodes.size());
+        m_nodes.emplace_back();
+        m_sah_cost = 0.f;
+        flatten(group_roots[i], m_group_roots.back(), 0, false);
+        buildTrianglePackets(first_ref);
+
+        uint32_t group_triangles = 0;
+        for (uint32_t mesh_idx : m_groups[i])
+            group_triangles += m_meshes[mesh_idx]->getTriangleCount();
+        const BoundingBox3f& bbox = group_roots[i]->bbox;
+        m_group_bboxes.push_back(bbox);
+        if (bbox.isValid() && bbox.getSurfaceArea() > 0.f)
+            sah_cost += m_sah_cost / bbox.getSurfaceArea() * group_triangles;
+        num_triangles += group_triangles;
+        delete group_roots[i];
+    }
+    m_sah_cost = num_triangles > 0 ? sah_cost / num_triangles : 0.f;
+
+    // replace the full precision nodes by the quantized ones, only the box of each root is kept
+    size_t num_linear_nodes = m_nodes.size();
+    size_t node_size = sizeof(LinearNode);
+    float quantized_sah_cost = m_sah_cost;
+    if (m_node_format == EQuantized16) {
+        quantize(m_nodes16, quantized_sah_cost);
+        node_size = sizeof(QuantizedNode<uint16_t>);
+    } else if (m_node_format == EQuantized8) {
+        quantize(m_nodes8, quantized_sah_cost);
+        node_size = sizeof(QuantizedNode<uint8_t>);
+    }
+    if (m_node_format != EFullPrecision)
+        m_nodes = decltype(m_nodes)();
+
+    m_build_sah_cost = m_sah_cost;
+    m_build_time = duration<float, std::milli>(high_resolution_clock::now() - start).count();
+
+    printf("%s build time: %ldms (flattening: %ldms) \n", getTypeName(),
+           duration_cast<milliseconds>(high_resolution_clock::now() - start).count(),
+           duration_cast<milliseconds>(high_resolution_clock::now() - build_end).count());
+    printf("Instances: %d (bottom level hierarchies: %d, top level nodes: %d) \n", num_instances, num_groups, num_top_level_nodes);
+    printf("Num nodes: %d \n", m_num_nodes);
+    printf("Num leaf nodes: %d \n", m_num_leaf_nodes);
+    printf("Num non-empty leaf nodes: %d \n", m_num_nonempty_leaf_nodes);
+    printf("Total number of saved triangles: %d \n", m_num_triangles_saved);
+    if (m_type != EBVH)
+        printf("Duplicated references: %d (%.1f%% of %d triangles) \n", (int) (m_num_triangles_saved - num_triangles),
+               num_triangles > 0 ? (m_num_triangles_saved - num_triangles) * 100.f / num_triangles : 0.f, num_triangles);
+    printf("Avg triangles per node: %f \n", (float)m_num_triangles_saved / (float)m_num_nodes);
+    printf("Recursion depth: %d \n", m_recursion_depth);
+    if (m_node_format == EFullPrecision)
+        printf("SAH cost: %f \n", m_sah_cost);
+    else
+        printf("SAH cost: %f (quantized: %f, %+.1f%%) \n", m_sah_cost, quantized_sah_cost,
+               m_sah_cost > 0.f ? (quantized_sah_cost / m_sah_cost - 1.f) * 100.f : 0.f);
+    printf("SIMD kernels: %s \n", m_simd_level == ESIMDAVX2 ? "AVX2" : (m_simd_level == ESIMDSSE ? "SSE" : "none"));
+    printf("Triangle test: %s \n", m_watertight ? "watertight" : "Moeller-Trumbore");
+    printf("Node format: %s (%s, %.0f%% less than full precision) \n",
+           m_node_format == EQuantized16 ? "16 bit" : (m_node_format == EQuantized8 ? "8 bit" : "full precision"),
+           memString(num_linear_nodes * node_size).c_str(), (1.f - (float) node_size / sizeof(LinearNode)) * 100.f);
+    printf("Node memory: %s \n", memString(getMemoryUsage()).c_str());
+
+    if (!m_cache_file.empty() && !saveCache(cache_key))
+        cerr << "Warning: could not write the acceleration structure cache \"" << m_cache_file << "\"" << endl;
+}
+
+void Accel::clear() {
+    m_nodes = decltype(m_nodes)();
+    m_nodes16 = decltype(m_nodes16)();
+    m_nodes8 = decltype(m_nodes8)();
+    m_group_roots.clear();
+    m_group_bboxes.clear();
+    m_triangle_refs.clear();
+    m_mesh_refs.clear();
+    m_instance_refs.clear();
+    m_triangle_packets.clear();
+    m_num_nonempty_leaf_nodes = m_num_leaf_nodes = m_num_nodes = 0;
+    m_recursion_depth = m_num_triangles_saved = 0;
+    m_sah_cost = 0.f;
+}
+
+Accel::TraversalStatistics Accel::getStatistics() const {
+    TraversalStatistics total;
+    for (const TraversalStatistics& stats : m_statistics)
+        total += stats;
+    return total;
+}
+
+size_t Accel::getMemoryUsage() const {
+    return m_nodes.size() * sizeof(LinearNode) +
+           m_nodes16.size() * sizeof(QuantizedNode<uint16_t>) +
+           m_nodes8.size() * sizeof(QuantizedNode<uint8_t>) +
+           m_group_roots.size() * sizeof(uint32_t) +
+           m_group_bboxes.size() * sizeof(BoundingBox3f) +
+           (m_triangle_refs.size() + m_mesh_refs.size() + m_instance_refs.size()) * sizeof(uint32_t) +
+           m_triangle_packets.size() * sizeof(TrianglePacket) +
+           m_instances.size() * sizeof(InstanceData);
+}
+
+Accel::Node* Accel::buildGroup(const std::vector<uint32_t>& group) {
+    uint32_t num_triangles = 0;
+    BoundingBox3f bbox;
+    for (uint32_t mesh_idx : group) {
         num_triangles += m_meshes[mesh_idx]->getTriangleCount();
+        bbox.expandBy(m_meshes[mesh_idx]->getBoundingBox());
     }
 
     std::vector<uint32_t> triangles(num_triangles);
     std::vector<uint32_t> mesh_indices(num_triangles);
     uint32_t offset = 0;
 
-    for (uint32_t current_mesh_idx = 0; current_mesh_idx < m_num_meshes; current_mesh_idx++) {
+    for (uint32_t current_mesh_idx : group) {
         uint32_t num_triangles_mesh = m_meshes[current_mesh_idx]->getTriangleCount();
         for (uint32_t i = 0; i < num_triangles_mesh; i++) {
             triangles[offset + i] = i;
@@ -58,96 +345,953 @@ void Accel::build() {
         offset += num_triangles_mesh;
     }
 
-    m_root = buildRecursive(m_bbox, triangles, mesh_indices, 0);
-    printf("Octree build time: %ldms \n", duration_cast<milliseconds>(high_resolution_clock::now() - start).count());
-    printf("Num nodes: %d \n", m_num_nodes);
-    printf("Num leaf nodes: %d \n", m_num_leaf_nodes);
-    printf("Num non-empty leaf nodes: %d \n", m_num_nonempty_leaf_nodes);
-    printf("Total number of saved triangles: %d \n", m_num_triangles_saved);
-    printf("Avg triangles per node: %f \n", (float)m_num_triangles_saved / (float)m_num_nodes);
-    printf("Recursion depth: %d \n", m_recursion_depth);
+    if (m_type == EOctree)
+        return buildRecursive(bbox, triangles, mesh_indices, 0);
+
+    // precompute bounds and centroids, the BVH builder only shuffles these records around
+    std::vector<BVHPrimitive> primitives(num_triangles);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, num_triangles, PARALLEL_BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            BVHPrimitive& primitive = primitives[i];
+            primitive.triangle_idx = triangles[i];
+            primitive.mesh_idx = mesh_indices[i];
+            primitive.bbox = m_meshes[mesh_indices[i]]->getBoundingBox(triangles[i]);
+            primitive.centroid = primitive.bbox.getCenter();
+        }
+    });
+    triangles = std::vector<uint32_t>();
+    mesh_indices = std::vector<uint32_t>();
+
+    if (m_type == ESBVH) {
+        uint32_t split_budget = (uint32_t) std::min(m_split_budget * num_triangles, (float) std::numeric_limits<uint32_t>::max() / 2);
+        return buildSBVHRecursive(primitives, 0, bbox.getSurfaceArea(), split_budget);
+    }
+
+    std::vector<BVHPrimitive> scratch(num_triangles);
+    return buildBVHRecursive(primitives.data(), scratch.data(), num_triangles, 0, MAX_TRIANGLES_PER_NODE);
+}
+
+void Accel::buildTrianglePackets(uint32_t first_ref) {
+    uint32_t first_packet = first_ref / SIMD_PACKET_SIZE;
+    uint32_t num_refs = (uint32_t) m_triangle_refs.size();
+    m_triangle_packets.resize((num_refs + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(first_packet, (uint32_t) m_triangle_packets.size(), PARALLEL_BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            TrianglePacket& packet = m_triangle_packets[i];
+            for (uint32_t lane = 0; lane < SIMD_PACKET_SIZE; lane++) {
+                // the scalar path does not pad its leaves, the last packet may be incomplete
+                uint32_t ref = std::min(i * SIMD_PACKET_SIZE + lane, num_refs - 1);
+                const Mesh* mesh = m_meshes[m_mesh_refs[ref]];
+                const MeshMatrixXf& V = mesh->getVertexPositions();
+                uint32_t triangle_idx = m_triangle_refs[ref];
+                Point3f p0 = V.col(mesh->getVertexIndex(triangle_idx, 0)), p1 = V.col(mesh->getVertexIndex(triangle_idx, 1)),
+                        p2 = V.col(mesh->getVertexIndex(triangle_idx, 2));
+                for (int axis = 0; axis < 3; axis++) {
+                    packet.v0[axis][lane] = p0[axis];
+                    packet.edge1[axis][lane] = m_watertight ? p1[axis] : p1[axis] - p0[axis];
+                    packet.edge2[axis][lane] = m_watertight ? p2[axis] : p2[axis] - p0[axis];
+                }
+            }
+        }
+    });
 }
 
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
-    bool foundIntersection;  // Was an intersection found so far?
-    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
+uint32_t Accel::intersectChildren(const LinearNode* children, uint32_t num_children, const Ray3f& ray,
+        const SIMDRay& simd_ray, float* near_t) const {
+    if (m_simd_level == ESIMDAVX2)
+        return intersectChildrenAVX2(children, num_children, simd_ray, ray.maxt, near_t);
+    if (m_simd_level == ESIMDSSE)
+        return intersectChildrenSSE(children, num_children, simd_ray, ray.maxt, near_t);
 
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    uint32_t hit_mask = 0;
+    for (uint32_t i = 0; i < num_children; i++)
+        if (intersectBox(children[i].bbox, ray, near_t[i]))
+            hit_mask |= 1u << i;
+    return hit_mask;
+}
+
+/// Largest fixed point value of a quantized bound
+template <typename T> static constexpr float quantizedMax() {
+    return (float) std::numeric_limits<T>::max();
+}
 
-    foundIntersection = traverseRecursive(*m_root, ray, its, shadowRay, f);
-    if (shadowRay)
-        return foundIntersection;
+/**
+ * Decode a quantized bound relative to the parent interval [lo, hi]. Both
+ * end points are reproduced exactly, so children that touch the bounds of
+ * their parent don't grow with every level.
+ */
+template <typename T> static inline float decodeBound(float lo, float hi, T value) {
+    float f = (float) value * (1.f / quantizedMax<T>());
+    return lo * (1.f - f) + hi * f;
+}
 
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
+template <> const Accel::QuantizedNode<uint16_t>* Accel::getQuantizedNodes<uint16_t>() const {
+    return m_nodes16.data();
+}
+
+template <> const Accel::QuantizedNode<uint8_t>* Accel::getQuantizedNodes<uint8_t>() const {
+    return m_nodes8.data();
+}
+
+template <typename T> Accel::LinearNode Accel::loadNode(const NodeRef<QuantizedNode<T>>& ref) const {
+    const QuantizedNode<T>& quantized = getQuantizedNodes<T>()[ref.node_idx];
+    LinearNode node;
+    node.bbox.min = Point3f(ref.bbox_min[0], ref.bbox_min[1], ref.bbox_min[2]);
+    node.bbox.max = Point3f(ref.bbox_max[0], ref.bbox_max[1], ref.bbox_max[2]);
+    node.offset = quantized.offset;
+    node.num_triangles = quantized.num_triangles;
+    node.num_children = quantized.num_children;
+    node.axis = quantized.axis;
+    return node;
+}
+
+template <typename T> const Accel::LinearNode* Accel::loadChildren(const NodeRef<QuantizedNode<T>>&, const LinearNode& node,
+        LinearNode* children) const {
+    const QuantizedNode<T>* quantized = &getQuantizedNodes<T>()[node.offset];
+    for (uint32_t i = 0; i < node.num_children; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            children[i].bbox.min[axis] = decodeBound(node.bbox.min[axis], node.bbox.max[axis], quantized[i].bbox_min[axis]);
+            children[i].bbox.max[axis] = decodeBound(node.bbox.min[axis], node.bbox.max[axis], quantized[i].bbox_max[axis]);
+        }
+        children[i].offset = quantized[i].offset;
+        children[i].num_triangles = quantized[i].num_triangles;
+        children[i].num_children = quantized[i].num_children;
+        children[i].axis = quantized[i].axis;
+    }
+    return children;
+}
+
+template <typename T> float Accel::quantizeChildren(QuantizedNode<T>* nodes, uint32_t node_idx, const BoundingBox3f& bbox) const {
+    const LinearNode& node = m_nodes[node_idx];
+    if (node.num_children == 0)
+        return intersectionCost(node.num_triangles) * bbox.getSurfaceArea();
+
+    float sah_cost = BVH_TRAVERSAL_COST * bbox.getSurfaceArea();
+    for (uint32_t i = 0; i < node.num_children; i++) {
+        uint32_t child_idx = node.offset + i;
+        const BoundingBox3f& exact = m_nodes[child_idx].bbox;
+        QuantizedNode<T>& quantized = nodes[child_idx];
+        BoundingBox3f decoded;
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = bbox.min[axis], hi = bbox.max[axis], extent = hi - lo;
+            float q_min = 0.f, q_max = quantizedMax<T>();
+            if (extent > 0.f) {
+                q_min = clamp(std::floor((exact.min[axis] - lo) / extent * quantizedMax<T>()), 0.f, quantizedMax<T>());
+                q_max = clamp(std::ceil((exact.max[axis] - lo) / extent * quantizedMax<T>()), 0.f, quantizedMax<T>());
+            }
+            quantized.bbox_min[axis] = (T) q_min;
+            quantized.bbox_max[axis] = (T) q_max;
+
+            // round outwards until the decoded box really contains the child
+            while (quantized.bbox_min[axis] > 0 && decodeBound(lo, hi, quantized.bbox_min[axis]) > exact.min[axis])
+                quantized.bbox_min[axis]--;
+            while (quantized.bbox_max[axis] < std::numeric_limits<T>::max() &&
+                   decodeBound(lo, hi, quantized.bbox_max[axis]) < exact.max[axis])
+                quantized.bbox_max[axis]++;
+            decoded.min[axis] = decodeBound(lo, hi, quantized.bbox_min[axis]);
+            decoded.max[axis] = decodeBound(lo, hi, quantized.bbox_max[axis]);
+        }
+        sah_cost += quantizeChildren(nodes, child_idx, decoded);
+    }
+    return sah_cost;
+}
+
+template <typename T> void Accel::quantize(std::vector<QuantizedNode<T>, tbb::cache_aligned_allocator<QuantizedNode<T>>>& nodes,
+        float& sah_cost) const {
+    nodes.resize(m_nodes.size());
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) m_nodes.size(), PARALLEL_BUILD_GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            // roots keep the full range, their boxes are stored separately
+            for (int axis = 0; axis < 3; axis++) {
+                nodes[i].bbox_min[axis] = 0;
+                nodes[i].bbox_max[axis] = std::numeric_limits<T>::max();
+            }
+            nodes[i].offset = m_nodes[i].offset;
+            nodes[i].num_triangles = m_nodes[i].num_triangles;
+            nodes[i].num_children = m_nodes[i].num_children;
+            nodes[i].axis = m_nodes[i].axis;
+        }
+    });
+
+    // every bottom level is quantized by its own task, the SAH cost is averaged like in build()
+    uint32_t num_groups = (uint32_t) m_groups.size();
+    std::vector<float> group_costs(num_groups);
+    tbb::parallel_for(0u, num_groups + 1, [&](uint32_t i) {
+        if (i == num_groups) {
+            quantizeChildren(nodes.data(), 0, m_top_level_bbox);
+            return;
+        }
+        const BoundingBox3f& bbox = m_group_bboxes[i];
+        float cost = quantizeChildren(nodes.data(), m_group_roots[i], bbox);
+        group_costs[i] = bbox.isValid() && bbox.getSurfaceArea() > 0.f ? cost / bbox.getSurfaceArea() : 0.f;
+    });
+
+    sah_cost = averageSAHCost(group_costs);
+}
+
+float Accel::averageSAHCost(const std::vector<float>& group_costs) const {
+    float sah_cost = 0.f;
+    uint32_t num_triangles = 0;
+    for (uint32_t i = 0; i < (uint32_t) m_groups.size(); i++) {
+        uint32_t group_triangles = 0;
+        for (uint32_t mesh_idx : m_groups[i])
+            group_triangles += m_meshes[mesh_idx]->getTriangleCount();
+        sah_cost += group_costs[i] * group_triangles;
+        num_triangles += group_triangles;
+    }
+    return num_triangles > 0 ? sah_cost / num_triangles : 0.f;
+}
+
+bool Accel::refit() {
+    if (m_group_roots.empty())
+        throw NoriException("Accel::refit(): the acceleration structure has not been built yet!");
+
+    /* Quantized boxes are stored relative to the boxes of the last build.
+       The leaves of the octree and the SBVH are clipped to the bounds of
+       their cells and splits, refitting them to whole triangles would loosen
+       them and inflate the SAH cost compared to the build */
+    if (m_node_format != EFullPrecision || m_type != EBVH) {
+        build();
+        return true;
+    }
+
+    auto start = high_resolution_clock::now();
+    uint32_t num_groups = (uint32_t) m_groups.size();
+    std::vector<float> group_costs(num_groups);
+    tbb::parallel_for(0u, num_groups, [&](uint32_t i) {
+        float cost = refitRecursive(m_group_roots[i], 0, false);
+        const BoundingBox3f& bbox = m_group_bboxes[i] = m_nodes[m_group_roots[i]].bbox;
+        group_costs[i] = bbox.isValid() && bbox.getSurfaceArea() > 0.f ? cost / bbox.getSurfaceArea() : 0.f;
+    });
+
+    // the instance boxes of the top level depend on the bottom levels
+    refitRecursive(0, 0, true);
+    m_bbox = m_top_level_bbox = m_nodes[0].bbox;
+    buildTrianglePackets(0);
+
+    float sah_cost = averageSAHCost(group_costs);
+    if (sah_cost > REFIT_MAX_SAH_INCREASE * m_build_sah_cost) {
+        printf("%s refit degraded the SAH cost from %f to %f, rebuilding \n", getTypeName(), m_build_sah_cost, sah_cost);
+        build();
+        return true;
+    }
+
+    m_sah_cost = sah_cost;
+    printf("%s refit time: %ldms (SAH cost: %f, %+.1f%% since the last build) \n", getTypeName(),
+           duration_cast<milliseconds>(high_resolution_clock::now() - start).count(), m_sah_cost,
+           m_build_sah_cost > 0.f ? (m_sah_cost / m_build_sah_cost - 1.f) * 100.f : 0.f);
+    return false;
+}
+
+float Accel::refitRecursive(uint32_t node_idx, uint32_t recursion_depth, bool top_level) {
+    LinearNode& node = m_nodes[node_idx];
+    BoundingBox3f bbox;
+
+    if (node.num_children == 0) {
+        for (uint32_t i = node.offset; i < node.offset + node.num_triangles; i++) {
+            if (top_level)
+                bbox.expandBy(getInstanceBoundingBox(m_instances[m_instance_refs[i]]));
+            else
+                bbox.expandBy(m_meshes[m_mesh_refs[i]]->getBoundingBox(m_triangle_refs[i]));
+        }
+        node.bbox = bbox;
+        return node.num_triangles > 0 && !top_level ? intersectionCost(node.num_triangles) * bbox.getSurfaceArea() : 0.f;
+    }
+
+    float child_costs[8];
+    auto refit_child = [&](uint32_t child) {
+        child_costs[child] = refitRecursive(node.offset + child, recursion_depth + 1, top_level);
+    };
+    if (recursion_depth < REFIT_PARALLEL_DEPTH) {
+        tbb::parallel_for(0u, (uint32_t) node.num_children, refit_child);
+    } else {
+        for (uint32_t child = 0; child < node.num_children; child++)
+            refit_child(child);
+    }
+
+    float cost = top_level ? 0.f : BVH_TRAVERSAL_COST;
+    for (uint32_t child = 0; child < node.num_children; child++)
+        bbox.expandBy(m_nodes[node.offset + child].bbox);
+    cost *= bbox.isValid() ? bbox.getSurfaceArea() : 0.f;
+    for (uint32_t child = 0; child < node.num_children; child++)
+        cost += child_costs[child];
+    node.bbox = bbox;
+    return cost;
+}
+
+void Accel::flatten(const Node* node, uint32_t node_idx, uint32_t recursion_depth, bool top_level) {
+    // statistics are gathered here, so that the (parallel) builders don't need to synchronize
+    if (!top_level) {
+        m_num_nodes++;
+        m_recursion_depth = std::max(m_recursion_depth, recursion_depth);
+    }
+
+    if (!node->child) {
+        if (node->num_triangles > (1u << 24) - 1)
+            throw NoriException("Accel: leaf with %d triangles cannot be stored!", node->num_triangles);
+        std::vector<uint32_t>& refs = top_level ? m_instance_refs : m_triangle_refs;
+        LinearNode& leaf = m_nodes[node_idx];
+        leaf.bbox = node->bbox;
+        leaf.offset = (uint32_t) refs.size();
+        leaf.num_triangles = node->num_triangles;
+        leaf.num_children = 0;
+        leaf.axis = 0;
+        refs.insert(refs.end(), node->triangle_indices, node->triangle_indices + node->num_triangles);
+        if (top_level)
+            return;
+        m_mesh_refs.insert(m_mesh_refs.end(), node->mesh_indices, node->mesh_indices + node->num_triangles);
+
+        m_num_leaf_nodes++;
+        if (node->num_triangles > 0)
+            m_num_nonempty_leaf_nodes++;
+        m_num_triangles_saved += node->num_triangles;
+        m_sah_cost += intersectionCost(node->num_triangles) * node->bbox.getSurfaceArea();
+
+        // leaves of the SIMD kernels start at a packet boundary, pad with copies of the last triangle
+        if (m_simd_level != ESIMDNone)
+            while (m_triangle_refs.size() % SIMD_PACKET_SIZE != 0) {
+                m_triangle_refs.push_back(m_triangle_refs.back());
+                m_mesh_refs.push_back(m_mesh_refs.back());
+            }
+        return;
+    }
+
+    if (!top_level)
+        m_sah_cost += BVH_TRAVERSAL_COST * node->bbox.getSurfaceArea();
+
+    uint32_t num_children = 0;
+    for (const Node* child = node->child; child; child = child->next)
+        num_children++;
+
+    // siblings start at an even index, so that a pair of BVH children shares a cache line
+    if (m_nodes.size() % 2 != 0)
+        m_nodes.emplace_back();
+    uint32_t first_child = (uint32_t) m_nodes.size();
+    m_nodes.resize(m_nodes.size() + num_children);
+
+    LinearNode& interior = m_nodes[node_idx];
+    interior.bbox = node->bbox;
+    interior.offset = first_child;
+    interior.num_triangles = 0;
+    interior.num_children = num_children;
+    interior.axis = node->axis;
+
+    uint32_t i = 0;
+    for (const Node* child = node->child; child; child = child->next)
+        flatten(child, first_child + i++, recursion_depth + 1, top_level);
+}
+
+void Accel::initSIMDRay(const Ray3f& ray, SIMDRay& simd_ray) {
+    for (int i = 0; i < 3; i++) {
+        simd_ray.o[i] = ray.o[i];
+        simd_ray.d[i] = ray.d[i];
+        simd_ray.dRcp[i] = std::isinf(ray.dRcp[i]) ? std::copysign(std::numeric_limits<float>::max(), ray.dRcp[i]) : ray.dRcp[i];
+    }
+    simd_ray.mint = ray.mint;
+
+    // z is the dominant axis of the direction, swapping x and y keeps the winding
+    int kz = std::abs(ray.d.x()) > std::abs(ray.d.y())
+        ? (std::abs(ray.d.x()) > std::abs(ray.d.z()) ? 0 : 2)
+        : (std::abs(ray.d.y()) > std::abs(ray.d.z()) ? 1 : 2);
+    int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+    if (ray.d[kz] < 0.f)
+        std::swap(kx, ky);
+    simd_ray.k[0] = kx;
+    simd_ray.k[1] = ky;
+    simd_ray.k[2] = kz;
+    simd_ray.shear[0] = ray.d[kx] / ray.d[kz];
+    simd_ray.shear[1] = ray.d[ky] / ray.d[kz];
+    simd_ray.shear[2] = 1.f / ray.d[kz];
+    simd_ray.stats = nullptr;
+}
+
+void Accel::initPacketQuery(const Ray3f* rays, uint32_t count, PacketQuery& query) const {
+    query.count = count;
+    query.active = (1u << count) - 1;
+    for (uint32_t i = 0; i < MAX_RAY_PACKET_SIZE; i++) {
+        RayPacket& packet = query.packet;
+        if (i >= count) {
+            // padding lanes, the empty segment [1, 0] never overlaps a box
+            for (int axis = 0; axis < 3; axis++)
+                packet.o[axis][i] = packet.dRcp[axis][i] = 0.f;
+            packet.mint[i] = 1.f;
+            packet.maxt[i] = 0.f;
+            continue;
+        }
+        query.rays[i] = rays[i];
+        initSIMDRay(rays[i], query.simd_rays[i]);
+        if (m_simd_level == ESIMDNone)
+            continue;
+        for (int axis = 0; axis < 3; axis++) {
+            packet.o[axis][i] = query.simd_rays[i].o[axis];
+            packet.dRcp[axis][i] = query.simd_rays[i].dRcp[axis];
+        }
+        packet.mint[i] = rays[i].mint;
+        packet.maxt[i] = rays[i].maxt;
+    }
+}
+
+template <typename NodeType, typename LeafFunction>
+bool Accel::traverse(uint32_t root, const BoundingBox3f& root_bbox, Ray3f& ray, const SIMDRay& simd_ray,
+        const LeafFunction& leaf_function) const {
+    bool found = false;
+
+    // children are visited front to back based on the sign of the ray direction, see below
+    uint32_t dir_is_neg[3] = { ray.d.x() < 0.f, ray.d.y() < 0.f, ray.d.z() < 0.f };
+    uint32_t octant = dir_is_neg[0] | (dir_is_neg[1] << 1) | (dir_is_neg[2] << 2);
+
+    StackEntry<NodeType> stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    // decoded children of quantized nodes, raw storage avoids constructing the boxes
+    typename std::aligned_storage<8 * sizeof(LinearNode), alignof(LinearNode)>::type children_storage;
+    LinearNode* children_buffer = reinterpret_cast<LinearNode*>(&children_storage);
+
+    TraversalStatistics* stats = simd_ray.stats;
+    if (stats)
+        stats->boxes_tested++;
+
+    float near_t[8];
+    if (intersectBox(root_bbox, ray, near_t[0]))
+        stack[stack_size++] = StackEntry<NodeType> { NodeRef<NodeType>::make(root, root_bbox), near_t[0] };
+
+    while (stack_size > 0) {
+        StackEntry<NodeType> entry = stack[--stack_size];
+
+        // a hit closer than the entry point of this node was found after it had been pushed
+        if (entry.near_t > ray.maxt)
+            continue;
+
+        const LinearNode& node = loadNode(entry.node);
+        if (stats) {
+            stats->nodes_visited++;
+            stats->boxes_tested += node.num_children;
+        }
+        if (node.num_children == 0) {
+            // the leaf function shortens the ray segment when it finds a closer hit
+            if (leaf_function(node))
+                found = true;
+            continue;
+        }
+
+        const LinearNode* children = loadChildren(entry.node, node, children_buffer);
+        uint32_t hit_mask = intersectChildren(children, node.num_children, ray, simd_ray, near_t);
+
+        /* BVH children are sorted along the split axis and octree children
+           are indexed by their octant (bit 0: x, bit 1: y, bit 2: z). XOR-ing
+           the child index with the direction sign bits therefore enumerates
+           the children from front to back. The nearest child is pushed last,
+           so that it is popped next. */
+        uint32_t order_mask = node.num_children == 2 ? dir_is_neg[node.axis] : octant;
+        for (uint32_t i = node.num_children; i > 0; i--) {
+            uint32_t child = (i - 1) ^ order_mask;
+            if ((hit_mask & (1u << child)) && (children[child].num_children > 0 || children[child].num_triangles > 0))
+                stack[stack_size++] = StackEntry<NodeType> {
+                    NodeRef<NodeType>::make(node.offset + child, children[child].bbox), near_t[child] };
+        }
+    }
+    return found;
+}
+
+template <typename NodeType, typename LeafFunction>
+bool Accel::traverseAnyHit(uint32_t root, const BoundingBox3f& root_bbox, const Ray3f& ray, const SIMDRay& simd_ray,
+        const LeafFunction& leaf_function) const {
+    /* Any intersection terminates the query, so the children are neither
+       ordered nor is the entry distance of a node remembered */
+    NodeRef<NodeType> stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+
+    typename std::aligned_storage<8 * sizeof(LinearNode), alignof(LinearNode)>::type children_storage;
+    LinearNode* children_buffer = reinterpret_cast<LinearNode*>(&children_storage);
+
+    TraversalStatistics* stats = simd_ray.stats;
+    if (stats)
+        stats->boxes_tested++;
+
+    float near_t[8];
+    if (intersectBox(root_bbox, ray, near_t[0]))
+        stack[stack_size++] = NodeRef<NodeType>::make(root, root_bbox);
+
+    while (stack_size > 0) {
+        NodeRef<NodeType> ref = stack[--stack_size];
+        const LinearNode& node = loadNode(ref);
+        if (stats) {
+            stats->nodes_visited++;
+            stats->boxes_tested += node.num_children;
+        }
+        if (node.num_children == 0) {
+            if (leaf_function(node))
+                return true;
+            continue;
+        }
+
+        const LinearNode* children = loadChildren(ref, node, children_buffer);
+        uint32_t hit_mask = intersectChildren(children, node.num_children, ray, simd_ray, near_t);
+        for (uint32_t i = 0; i < node.num_children; i++) {
+            if ((hit_mask & (1u << i)) && (children[i].num_children > 0 || children[i].num_triangles > 0))
+                stack[stack_size++] = NodeRef<NodeType>::make(node.offset + i, children[i].bbox);
+        }
+    }
+    return false;
+}
+
+template <typename NodeType, typename LeafFunction>
+void Accel::traversePacket(uint32_t root, const BoundingBox3f& root_bbox, PacketQuery& query, uint32_t mask,
+        const LeafFunction& leaf_function) const {
+    /* The whole packet uses the traversal order of its first ray, this
+       is only a heuristic, nodes are tested against every ray when they
+       are popped from the stack. */
+    uint32_t first = 0;
+    while (first < query.count && !(mask & (1u << first)))
+        first++;
+    if (first == query.count)
+        return;
+    const Ray3f& first_ray = query.rays[first];
+    uint32_t dir_is_neg[3] = { first_ray.d.x() < 0.f, first_ray.d.y() < 0.f, first_ray.d.z() < 0.f };
+    uint32_t octant = dir_is_neg[0] | (dir_is_neg[1] << 1) | (dir_is_neg[2] << 2);
+
+    PacketStackEntry<NodeType> stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = PacketStackEntry<NodeType> { NodeRef<NodeType>::make(root, root_bbox), mask };
+
+    typename std::aligned_storage<8 * sizeof(LinearNode), alignof(LinearNode)>::type children_storage;
+    LinearNode* children_buffer = reinterpret_cast<LinearNode*>(&children_storage);
+
+    while (stack_size > 0 && (mask & query.active)) {
+        PacketStackEntry<NodeType> entry = stack[--stack_size];
+        const LinearNode& node = loadNode(entry.node);
+
+        // only the rays that entered the parent can enter this node
+        uint32_t node_mask = 0;
+        if (m_simd_level == ESIMDAVX2) {
+            node_mask = intersectNodePacketAVX2(node, query.packet, query.count);
+        } else if (m_simd_level == ESIMDSSE) {
+            node_mask = intersectNodePacketSSE(node, query.packet, query.count);
+        } else {
+            for (uint32_t i = 0; i < query.count; i++) {
+                float near_t;
+                if ((entry.mask & query.active & (1u << i)) && intersectBox(node.bbox, query.rays[i], near_t))
+                    node_mask |= 1u << i;
+            }
+        }
+        node_mask &= entry.mask & query.active;
+        if (!node_mask)
+            continue;
+
+        if (node.num_children == 0) {
+            leaf_function(node, node_mask);
         } else {
-            its.shFrame = its.geoFrame;
+            // same front to back order as traverse()
+            const LinearNode* children = loadChildren(entry.node, node, children_buffer);
+            uint32_t order_mask = node.num_children == 2 ? dir_is_neg[node.axis] : octant;
+            for (uint32_t i = node.num_children; i > 0; i--) {
+                uint32_t child = (i - 1) ^ order_mask;
+                if (children[child].num_children > 0 || children[child].num_triangles > 0)
+                    stack[stack_size++] = PacketStackEntry<NodeType> {
+                        NodeRef<NodeType>::make(node.offset + child, children[child].bbox), node_mask };
+            }
         }
     }
+}
+
+bool Accel::intersectTriangle(const TrianglePacket& packet, uint32_t lane, const SIMDRay& ray,
+        float& u, float& v, float& t) {
+    const float edge1[3] = { packet.edge1[0][lane], packet.edge1[1][lane], packet.edge1[2][lane] };
+    const float edge2[3] = { packet.edge2[0][lane], packet.edge2[1][lane], packet.edge2[2][lane] };
+    const float* d = ray.d;
+
+    /* Begin calculating determinant - also used to calculate U parameter */
+    float pvec[3] = { d[1] * edge2[2] - d[2] * edge2[1], d[2] * edge2[0] - d[0] * edge2[2], d[0] * edge2[1] - d[1] * edge2[0] };
+    float det = edge1[0] * pvec[0] + edge1[1] * pvec[1] + edge1[2] * pvec[2];
+    if (det > -1e-8f && det < 1e-8f)
+        return false;
+    float inv_det = 1.0f / det;
+
+    /* Calculate distance from v[0] to ray origin */
+    float tvec[3] = { ray.o[0] - packet.v0[0][lane], ray.o[1] - packet.v0[1][lane], ray.o[2] - packet.v0[2][lane] };
+    u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * inv_det;
+    if (u < 0.f || u > 1.f)
+        return false;
+
+    /* Prepare to test V parameter */
+    float qvec[3] = { tvec[1] * edge1[2] - tvec[2] * edge1[1], tvec[2] * edge1[0] - tvec[0] * edge1[2], tvec[0] * edge1[1] - tvec[1] * edge1[0] };
+    v = (d[0] * qvec[0] + d[1] * qvec[1] + d[2] * qvec[2]) * inv_det;
+    if (v < 0.f || u + v > 1.f)
+        return false;
+
+    t = (edge2[0] * qvec[0] + edge2[1] * qvec[1] + edge2[2] * qvec[2]) * inv_det;
+    return t >= ray.mint;
+}
+
+bool Accel::intersectTriangleWatertight(const TrianglePacket& packet, uint32_t lane, const SIMDRay& ray,
+        float& u, float& v, float& t) {
+    const int kx = ray.k[0], ky = ray.k[1], kz = ray.k[2];
+
+    /* Vertices relative to the ray origin, sheared in x and y */
+    float az = packet.v0[kz][lane] - ray.o[kz];
+    float bz = packet.edge1[kz][lane] - ray.o[kz];
+    float cz = packet.edge2[kz][lane] - ray.o[kz];
+    float ax = packet.v0[kx][lane] - ray.o[kx] - ray.shear[0] * az;
+    float ay = packet.v0[ky][lane] - ray.o[ky] - ray.shear[1] * az;
+    float bx = packet.edge1[kx][lane] - ray.o[kx] - ray.shear[0] * bz;
+    float by = packet.edge1[ky][lane] - ray.o[ky] - ray.shear[1] * bz;
+    float cx = packet.edge2[kx][lane] - ray.o[kx] - ray.shear[0] * cz;
+    float cy = packet.edge2[ky][lane] - ray.o[ky] - ray.shear[1] * cz;
+
+    /* Scaled barycentric coordinates, all of them must have the same sign */
+    float e0 = cx * by - cy * bx;
+    float e1 = ax * cy - ay * cx;
+    float e2 = bx * ay - by * ax;
+    if ((e0 < 0.f || e1 < 0.f || e2 < 0.f) && (e0 > 0.f || e1 > 0.f || e2 > 0.f))
+        return false;
+    float det = e0 + e1 + e2;
+    if (det == 0.f)
+        return false;
+
+    float inv_det = 1.f / det;
+    u = e1 * inv_det;
+    v = e2 * inv_det;
+    t = ray.shear[2] * (e0 * az + e1 * bz + e2 * cz) * inv_det;
+    return t >= ray.mint;
+}
+
+int Accel::intersectLeafScalar(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const {
+    // search through all triangles in leaf
+    int hit = -1;
+    for (uint32_t i = 0; i < node.num_triangles; ++i) {
+        uint32_t ref = node.offset + i;
+        const TrianglePacket& packet = m_triangle_packets[ref / SIMD_PACKET_SIZE];
+        uint32_t lane = ref % SIMD_PACKET_SIZE;
+        float tri_u, tri_v, tri_t;
+        bool found = m_watertight ? intersectTriangleWatertight(packet, lane, ray, tri_u, tri_v, tri_t)
+                                  : intersectTriangle(packet, lane, ray, tri_u, tri_v, tri_t);
+        if (found && tri_t < maxt) {
+            u = tri_u;
+            v = tri_v;
+            t = maxt = tri_t;
+            hit = (int) i;
+        }
+    }
+    return hit;
+}
+
+bool Accel::intersectLeaf(const LinearNode& node, const Ray3f& ray, const SIMDRay& simd_ray,
+        uint32_t& ref, float& u, float& v, float& t) const {
+    if (TraversalStatistics* stats = simd_ray.stats)
+        stats->triangles_tested += m_simd_level == ESIMDNone ? node.num_triangles
+            : (node.num_triangles + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE * SIMD_PACKET_SIZE;
+
+    int hit;
+    if (m_simd_level == ESIMDAVX2)
+        hit = intersectLeafAVX2(node, simd_ray, ray.maxt, u, v, t);
+    else if (m_simd_level == ESIMDSSE)
+        hit = intersectLeafSSE(node, simd_ray, ray.maxt, u, v, t);
+    else
+        hit = intersectLeafScalar(node, simd_ray, ray.maxt, u, v, t);
+    if (hit < 0)
+        return false;
+    ref = node.offset + hit;
+    return true;
+}
+
+bool Accel::occludedLeaf(const LinearNode& node, const Ray3f& ray, const SIMDRay& simd_ray) const {
+    uint32_t ref;
+    float u, v, t;
+    return intersectLeaf(node, ray, simd_ray, ref, u, v, t);
+}
+
+template <typename NodeType>
+bool Accel::intersectGroup(uint32_t instance_idx, Ray3f& ray, const SIMDRay& simd_ray, HitRecord& hit) const {
+    uint32_t group_idx = m_instances[instance_idx].group_idx;
+    return traverse<NodeType>(m_group_roots[group_idx], m_group_bboxes[group_idx], ray, simd_ray, [&](const LinearNode& node) {
+        uint32_t ref;
+        float u, v, t;
+        if (!intersectLeaf(node, ray, simd_ray, ref, u, v, t))
+            return false;
+        ray.maxt = t;
+        hit = HitRecord { instance_idx, m_mesh_refs[ref], m_triangle_refs[ref], u, v, t, nullptr };
+        return true;
+    });
+}
+
+template <typename NodeType>
+bool Accel::occludedGroup(uint32_t group_idx, const Ray3f& ray, const SIMDRay& simd_ray) const {
+    return traverseAnyHit<NodeType>(m_group_roots[group_idx], m_group_bboxes[group_idx], ray, simd_ray, [&](const LinearNode& node) {
+        return occludedLeaf(node, ray, simd_ray);
+    });
+}
+
+template <typename NodeType>
+void Accel::tracePacketGroup(uint32_t instance_idx, PacketQuery& query, uint32_t mask, bool any_hit,
+        HitRecord* hits, uint32_t& found) const {
+    uint32_t group_idx = m_instances[instance_idx].group_idx;
+    traversePacket<NodeType>(m_group_roots[group_idx], m_group_bboxes[group_idx], query, mask,
+            [&](const LinearNode& node, uint32_t node_mask) {
+        for (uint32_t i = 0; i < query.count; i++) {
+            uint32_t ref;
+            float u, v, t;
+            if (!(node_mask & (1u << i)))
+                continue;
+            if (any_hit) {
+                if (occludedLeaf(node, query.rays[i], query.simd_rays[i])) {
+                    found |= 1u << i;
+                    query.active &= ~(1u << i);
+                }
+                continue;
+            }
+            if (!intersectLeaf(node, query.rays[i], query.simd_rays[i], ref, u, v, t))
+                continue;
+            found |= 1u << i;
+            query.rays[i].maxt = query.packet.maxt[i] = t;
+            hits[i] = HitRecord { instance_idx, m_mesh_refs[ref], m_triangle_refs[ref], u, v, t, nullptr };
+        }
+    });
+}
+
+template <typename NodeType>
+bool Accel::intersectInstance(uint32_t instance_idx, Ray3f& ray, const SIMDRay& simd_ray, HitRecord& hit) const {
+    const InstanceData& instance = m_instances[instance_idx];
+    if (!instance.transformed)
+        return intersectGroup<NodeType>(instance_idx, ray, simd_ray, hit);
+
+    /* The direction is not normalized after the transformation, so
+       distances along the local ray equal those along the world ray */
+    Ray3f local_ray = instance.to_local * ray;
+    SIMDRay local_simd_ray;
+    initSIMDRay(local_ray, local_simd_ray);
+    local_simd_ray.stats = simd_ray.stats;
+    if (!intersectGroup<NodeType>(instance_idx, local_ray, local_simd_ray, hit))
+        return false;
+    ray.maxt = local_ray.maxt;
+    return true;
+}
+
+template <typename NodeType>
+bool Accel::occludedInstance(uint32_t instance_idx, const Ray3f& ray, const SIMDRay& simd_ray) const {
+    const InstanceData& instance = m_instances[instance_idx];
+    if (!instance.transformed)
+        return occludedGroup<NodeType>(instance.group_idx, ray, simd_ray);
+
+    Ray3f local_ray = instance.to_local * ray;
+    SIMDRay local_simd_ray;
+    initSIMDRay(local_ray, local_simd_ray);
+    local_simd_ray.stats = simd_ray.stats;
+    return occludedGroup<NodeType>(instance.group_idx, local_ray, local_simd_ray);
+}
+
+template <typename NodeType>
+void Accel::tracePacketInstance(uint32_t instance_idx, PacketQuery& query, uint32_t mask, bool any_hit,
+        HitRecord* hits, uint32_t& found) const {
+    const InstanceData& instance = m_instances[instance_idx];
+    if (!instance.transformed) {
+        tracePacketGroup<NodeType>(instance_idx, query, mask, any_hit, hits, found);
+        return;
+    }
+
+    Ray3f local_rays[MAX_RAY_PACKET_SIZE];
+    for (uint32_t i = 0; i < query.count; i++)
+        local_rays[i] = (mask & (1u << i)) ? instance.to_local * query.rays[i] : query.rays[i];
+    PacketQuery local_query;
+    initPacketQuery(local_rays, query.count, local_query);
+    local_query.active = query.active & mask;
+
+    tracePacketGroup<NodeType>(instance_idx, local_query, mask, any_hit, hits, found);
+
+    for (uint32_t i = 0; i < query.count; i++)
+        if (mask & (1u << i))
+            query.rays[i].maxt = query.packet.maxt[i] = local_query.rays[i].maxt;
+    query.active &= local_query.active | ~mask;
+}
+
+template <typename NodeType>
+bool Accel::occludedScene(const Ray3f &ray, TraversalStatistics *stats) const {
+    SIMDRay simd_ray;
+    initSIMDRay(ray, simd_ray);
+    simd_ray.stats = stats ? stats : localStatistics();
+    if (simd_ray.stats)
+        simd_ray.stats->rays++;
+
+    return traverseAnyHit<NodeType>(0, m_top_level_bbox, ray, simd_ray, [&](const LinearNode& node) {
+        for (uint32_t i = 0; i < node.num_triangles; i++)
+            if (occludedInstance<NodeType>(m_instance_refs[node.offset + i], ray, simd_ray))
+                return true;
+        return false;
+    });
+}
+
+template <typename NodeType>
+bool Accel::intersectScene(const Ray3f &ray_, HitRecord &hit, TraversalStatistics *stats) const {
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    SIMDRay simd_ray;
+    initSIMDRay(ray, simd_ray);
+    simd_ray.stats = stats ? stats : localStatistics();
+    if (simd_ray.stats)
+        simd_ray.stats->rays++;
+
+    bool foundIntersection = traverse<NodeType>(0, m_top_level_bbox, ray, simd_ray, [&](const LinearNode& node) {
+        bool found = false;
+        for (uint32_t i = 0; i < node.num_triangles; i++)
+            if (intersectInstance<NodeType>(m_instance_refs[node.offset + i], ray, simd_ray, hit))
+                found = true;
+        return found;
+    });
+
+    if (foundIntersection) {
+        hit.t = ray.maxt;
+        hit.mesh = m_meshes[hit.mesh_idx];
+    }
 
     return foundIntersection;
 }
 
+template <typename NodeType>
+uint32_t Accel::tracePacketScene(const Ray3f *rays, Intersection *its, uint32_t count, bool any_hit) const {
+    if (count > MAX_RAY_PACKET_SIZE)
+        throw NoriException("Accel: ray packets are limited to %d rays!", MAX_RAY_PACKET_SIZE);
+    if (count == 0)
+        return 0;
+
+    PacketQuery query;
+    initPacketQuery(rays, count, query);
+
+    HitRecord hits[MAX_RAY_PACKET_SIZE]; // closest intersections
+    uint32_t found = 0;                  // rays with an intersection
+    traversePacket<NodeType>(0, m_top_level_bbox, query, query.active, [&](const LinearNode& node, uint32_t mask) {
+        for (uint32_t i = 0; i < node.num_triangles; i++)
+            tracePacketInstance<NodeType>(m_instance_refs[node.offset + i], query, mask & query.active, any_hit, hits, found);
+    });
+
+    if (!any_hit) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (found & (1u << i)) {
+                hits[i].t = query.rays[i].maxt;
+                computeSurfaceInteraction(hits[i], its[i]);
+            }
+        }
+    }
+
+    return found;
+}
+
+bool Accel::rayIntersect(const Ray3f &ray, Intersection &its, TraversalStatistics *stats) const {
+    HitRecord hit;
+    if (!rayIntersect(ray, hit, stats))
+        return false;
+    computeSurfaceInteraction(hit, its);
+    return true;
+}
+
+bool Accel::rayIntersect(const Ray3f &ray, HitRecord &hit, TraversalStatistics *stats) const {
+    switch (m_node_format) {
+        case EQuantized16: return intersectScene<QuantizedNode<uint16_t>>(ray, hit, stats);
+        case EQuantized8:  return intersectScene<QuantizedNode<uint8_t>>(ray, hit, stats);
+        default:           return intersectScene<LinearNode>(ray, hit, stats);
+    }
+}
+
+bool Accel::occluded(const Ray3f &ray, TraversalStatistics *stats) const {
+    switch (m_node_format) {
+        case EQuantized16: return occludedScene<QuantizedNode<uint16_t>>(ray, stats);
+        case EQuantized8:  return occludedScene<QuantizedNode<uint8_t>>(ray, stats);
+        default:           return occludedScene<LinearNode>(ray, stats);
+    }
+}
+
+uint32_t Accel::rayIntersectPacket(const Ray3f *rays, Intersection *its, uint32_t count) const {
+    switch (m_node_format) {
+        case EQuantized16: return tracePacketScene<QuantizedNode<uint16_t>>(rays, its, count, false);
+        case EQuantized8:  return tracePacketScene<QuantizedNode<uint8_t>>(rays, its, count, false);
+        default:           return tracePacketScene<LinearNode>(rays, its, count, false);
+    }
+}
+
+uint32_t Accel::occludedPacket(const Ray3f *rays, uint32_t count) const {
+    switch (m_node_format) {
+        case EQuantized16: return tracePacketScene<QuantizedNode<uint16_t>>(rays, nullptr, count, true);
+        case EQuantized8:  return tracePacketScene<QuantizedNode<uint8_t>>(rays, nullptr, count, true);
+        default:           return tracePacketScene<LinearNode>(rays, nullptr, count, true);
+    }
+}
+
+void Accel::computeSurfaceInteraction(const HitRecord& hit, Intersection &its) const {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+    const InstanceData& instance = m_instances[hit.instance_idx];
+    its.t = hit.t;
+    its.mesh = m_meshes[hit.mesh_idx];
+    its.uv = Point2f(hit.u, hit.v);
+    uint32_t f = hit.triangle_idx;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers, compact normals and
+       texture coordinates are decoded by the mesh on access */
+    const Mesh *mesh   = its.mesh;
+    const MeshMatrixXf &V  = mesh->getVertexPositions();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = mesh->getVertexIndex(f, 0), idx1 = mesh->getVertexIndex(f, 1), idx2 = mesh->getVertexIndex(f, 2);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (mesh->hasVertexTexCoords())
+        its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+            bary.y() * mesh->getVertexTexCoord(idx1) +
+            bary.z() * mesh->getVertexTexCoord(idx2);
+
+    /* The mesh data is stored in object space, instances move the
+       position and both normals into world space */
+    Normal3f geo_normal((p1-p0).cross(p2-p0));
+    if (instance.transformed) {
+        its.p = instance.to_world * its.p;
+        geo_normal = instance.to_world * geo_normal;
+    }
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame(geo_normal.normalized());
+
+    if (mesh->hasVertexNormals()) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        Normal3f sh_normal(
+            bary.x() * mesh->getVertexNormal(idx0) +
+            bary.y() * mesh->getVertexNormal(idx1) +
+            bary.z() * mesh->getVertexNormal(idx2));
+        if (instance.transformed)
+            sh_normal = instance.to_world * sh_normal;
+        its.shFrame = Frame(sh_normal.normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
+}
+
 Accel::Node* Accel::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32_t>& triangle_indices,
         std::vector<uint32_t>& mesh_indices, uint32_t recursion_depth) {
-    // a node is created in any case
-    m_num_nodes++;
-
     uint32_t num_triangles = triangle_indices.size();
 
     // return empty node if no triangles are left
     if (num_triangles == 0) {
         Node* node = new Node();
         node->bbox = BoundingBox3f(bbox);
-
-        // add to statistics
-        m_num_leaf_nodes++;
         return node;
     }
 
@@ -163,11 +1307,6 @@ Accel::Node* Accel::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32
             node->mesh_indices[i] = mesh_indices[i];
         }
         node->bbox = BoundingBox3f(bbox);
-
-        // add to statistics
-        m_num_leaf_nodes++;
-        m_num_nonempty_leaf_nodes++;
-        m_num_triangles_saved += num_triangles;
         return node;
     }
 
@@ -178,99 +1317,489 @@ Accel::Node* Accel::buildRecursive(const BoundingBox3f& bbox, std::vector<uint32
     BoundingBox3f child_bboxes[8] = {};
     subdivideBBox(bbox, child_bboxes);
 
+    bool parallel = num_triangles >= PARALLEL_BUILD_THRESHOLD;
+
+    // compute the triangle bounding boxes once, they are tested against every child
+    std::vector<BoundingBox3f> triangle_bboxes(num_triangles);
+    auto compute_bboxes = [&](const tbb::blocked_range<uint32_t>& range) {
+        for (uint32_t j = range.begin(); j < range.end(); j++)
+            triangle_bboxes[j] = m_meshes[mesh_indices[j]]->getBoundingBox(triangle_indices[j]);
+    };
+    tbb::blocked_range<uint32_t> triangle_range(0, num_triangles, PARALLEL_BUILD_GRAIN_SIZE);
+    if (parallel)
+        tbb::parallel_for(triangle_range, compute_bboxes);
+    else
+        compute_bboxes(triangle_range);
+
     std::vector<std::vector<uint32_t>> child_triangle_indices(8);
     std::vector<std::vector<uint32_t>> child_mesh_indices(8);
 
-    uint32_t child_num_triangles[8] = {};
-
-    // place every triangle in the children it overlaps with
-    // for every child bbox
-    for (uint32_t i = 0; i < 8; i++) {
-        // for every triangle inside of the parent create triangle bounding box
+    // place every triangle in the children it overlaps with, every child is filled by its own task
+    auto classify = [&](uint32_t i) {
         for (uint32_t j = 0; j < num_triangles; j++) {
-            // for every triangle vertex expand triangle bbox
-            uint32_t triangle_idx = triangle_indices[j];
-            uint32_t mesh_idx = mesh_indices[j];
-            BoundingBox3f triangle_bbox = m_meshes[mesh_idx]->getBoundingBox(triangle_idx);
-
             // check if triangle is in bbox, if so put triangle index into triangle list of child
-            if (child_bboxes[i].overlaps(triangle_bbox)) {
-                child_triangle_indices[i].emplace_back(triangle_idx);
-                child_mesh_indices[i].emplace_back(mesh_idx);
-                child_num_triangles[i]++;
+            if (child_bboxes[i].overlaps(triangle_bboxes[j])) {
+                child_triangle_indices[i].emplace_back(triangle_indices[j]);
+                child_mesh_indices[i].emplace_back(mesh_indices[j]);
             }
         }
-    }
+    };
+    if (parallel)
+        tbb::parallel_for(0u, 8u, classify);
+    else
+        for (uint32_t i = 0; i < 8; i++)
+            classify(i);
 
     // release memory to avoid stack overflow
+    triangle_bboxes = std::vector<BoundingBox3f>();
     triangle_indices = std::vector<uint32_t>();
     mesh_indices = std::vector<uint32_t>();
 
-    // for every child bbox
-    for (uint32_t i = 0; i < 8; i++) {
-        Node* last_child;
-        // first child
-        if (i == 0) {
-            node->child = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
-            last_child = node->child;
-        // neighbour children
-        } else {
-            last_child->next = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
-            last_child = last_child->next;
+    Node* children[8];
+    auto build_child = [&](uint32_t i) {
+        children[i] = buildRecursive(child_bboxes[i], child_triangle_indices[i], child_mesh_indices[i], recursion_depth + 1);
+    };
+    if (parallel)
+        tbb::parallel_for(0u, 8u, build_child);
+    else
+        for (uint32_t i = 0; i < 8; i++)
+            build_child(i);
+
+    // link the children
+    node->child = children[0];
+    for (uint32_t i = 1; i < 8; i++)
+        children[i - 1]->next = children[i];
+    return node;
+}
+
+Accel::Node* Accel::buildBVHRecursive(BVHPrimitive* primitives, BVHPrimitive* scratch, uint32_t num_primitives,
+        uint32_t recursion_depth, uint32_t max_leaf_size) {
+    bool parallel = num_primitives >= PARALLEL_BUILD_THRESHOLD;
+    tbb::blocked_range<uint32_t> primitive_range(0, num_primitives, PARALLEL_BUILD_GRAIN_SIZE);
+
+    // bounds of the triangles and of their centroids
+    auto compute_bounds = [&](const tbb::blocked_range<uint32_t>& range, BVHBounds bounds) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            bounds.bbox.expandBy(primitives[i].bbox);
+            bounds.centroid_bbox.expandBy(primitives[i].centroid);
         }
-        m_recursion_depth = std::max(m_recursion_depth, recursion_depth + 1);
+        return bounds;
+    };
+    BVHBounds bounds = parallel
+        ? tbb::parallel_reduce(primitive_range, BVHBounds(), compute_bounds, BVHBounds::merge)
+        : compute_bounds(primitive_range, BVHBounds());
+    const BoundingBox3f& bbox = bounds.bbox;
+    const BoundingBox3f& centroid_bbox = bounds.centroid_bbox;
+
+    float leaf_cost = intersectionCost(num_primitives);
+    if (num_primitives <= 1 || recursion_depth >= BVH_MAX_DEPTH)
+        return createLeaf(bbox, primitives, num_primitives);
+
+    BVHSplit split = findObjectSplit(primitives, num_primitives, centroid_bbox, parallel);
+    float split_cost = BVH_TRAVERSAL_COST + split.cost / bbox.getSurfaceArea();
+
+    // all centroids coincide, there is no way to separate the triangles
+    if (split.axis < 0) {
+        if (num_primitives <= max_leaf_size)
+            return createLeaf(bbox, primitives, num_primitives);
+    } else if (num_primitives <= max_leaf_size && leaf_cost <= split_cost) {
+        return createLeaf(bbox, primitives, num_primitives);
+    }
+
+    uint32_t num_left;
+    if (split.axis < 0) {
+        // too many identical centroids for a single leaf, fall back to splitting the list in half
+        num_left = num_primitives / 2;
+    } else if (!parallel) {
+        BVHPrimitive* mid = std::partition(primitives, primitives + num_primitives, [&](const BVHPrimitive& primitive) {
+            return split.isLeft(primitive);
+        });
+        num_left = (uint32_t) (mid - primitives);
+    } else {
+        /* Parallel partition through the scratch buffer: count the left side of every
+           chunk, turn the counts into output offsets and scatter the chunks independently */
+        uint32_t num_chunks = (num_primitives + PARALLEL_BUILD_GRAIN_SIZE - 1) / PARALLEL_BUILD_GRAIN_SIZE;
+        std::vector<uint32_t> left_offsets(num_chunks + 1, 0);
+        tbb::parallel_for(0u, num_chunks, [&](uint32_t chunk) {
+            uint32_t end = std::min(num_primitives, (chunk + 1) * PARALLEL_BUILD_GRAIN_SIZE);
+            uint32_t count = 0;
+            for (uint32_t i = chunk * PARALLEL_BUILD_GRAIN_SIZE; i < end; i++)
+                count += split.isLeft(primitives[i]);
+            left_offsets[chunk + 1] = count;
+        });
+        for (uint32_t chunk = 0; chunk < num_chunks; chunk++)
+            left_offsets[chunk + 1] += left_offsets[chunk];
+        num_left = left_offsets[num_chunks];
+
+        tbb::parallel_for(0u, num_chunks, [&](uint32_t chunk) {
+            uint32_t begin = chunk * PARALLEL_BUILD_GRAIN_SIZE;
+            uint32_t end = std::min(num_primitives, begin + PARALLEL_BUILD_GRAIN_SIZE);
+            uint32_t left = left_offsets[chunk];
+            uint32_t right = num_left + begin - left_offsets[chunk];
+            for (uint32_t i = begin; i < end; i++) {
+                if (split.isLeft(primitives[i]))
+                    scratch[left++] = primitives[i];
+                else
+                    scratch[right++] = primitives[i];
+            }
+        });
+        tbb::parallel_for(primitive_range, [&](const tbb::blocked_range<uint32_t>& range) {
+            std::copy(scratch + range.begin(), scratch + range.end(), primitives + range.begin());
+        });
+    }
+
+    Node* node = new Node();
+    node->bbox = bbox;
+    node->axis = split.axis >= 0 ? split.axis : centroid_bbox.getLargestAxis();
+
+    Node* left;
+    Node* right;
+    auto build_left = [&] {
+        left = buildBVHRecursive(primitives, scratch, num_left, recursion_depth + 1, max_leaf_size);
+    };
+    auto build_right = [&] {
+        right = buildBVHRecursive(primitives + num_left, scratch + num_left, num_primitives - num_left, recursion_depth + 1, max_leaf_size);
+    };
+    if (parallel) {
+        tbb::parallel_invoke(build_left, build_right);
+    } else {
+        build_left();
+        build_right();
     }
+    node->child = left;
+    left->next = right;
     return node;
 }
 
-bool Accel::traverseRecursive(const Node& node, Ray3f &ray, Intersection &its, bool shadowRay, uint32_t& hit_idx) const {
-    bool foundIntersection = false;
+Accel::BVHSplit Accel::findObjectSplit(const BVHPrimitive* primitives, uint32_t num_primitives,
+        const BoundingBox3f& centroid_bbox, bool parallel) const {
+    // bin the centroids along every axis and evaluate the SAH at all bin boundaries
+    Vector3f centroid_extents = centroid_bbox.getExtents();
+    Vector3f bin_factors;
+    for (int axis = 0; axis < 3; axis++)
+        bin_factors[axis] = centroid_extents[axis] > 0.f ? BVH_NUM_BINS * (1.f - 1e-4f) / centroid_extents[axis] : 0.f;
 
-    // only check triangles of node and its children if ray intersects with node bbox
-    if (!node.bbox.rayIntersect(ray)) {
-        return false;
+    auto bin_index = [&](const BVHPrimitive& primitive, int axis) {
+        uint32_t bin = (uint32_t) ((primitive.centroid[axis] - centroid_bbox.min[axis]) * bin_factors[axis]);
+        return std::min(bin, BVH_NUM_BINS - 1);
+    };
+
+    auto compute_bins = [&](const tbb::blocked_range<uint32_t>& range, BVHBins bins) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                uint32_t bin = bin_index(primitives[i], axis);
+                bins.counts[axis][bin]++;
+                bins.bboxes[axis][bin].expandBy(primitives[i].bbox);
+            }
+        }
+        return bins;
+    };
+    tbb::blocked_range<uint32_t> primitive_range(0, num_primitives, PARALLEL_BUILD_GRAIN_SIZE);
+    BVHBins bins = parallel
+        ? tbb::parallel_reduce(primitive_range, BVHBins(), compute_bins, BVHBins::merge)
+        : compute_bins(primitive_range, BVHBins());
+
+    BVHSplit split;
+    for (int axis = 0; axis < 3; axis++) {
+        if (centroid_extents[axis] <= 0.f)
+            continue;
+
+        // sweep from the right to get the bounds of all right-hand sides
+        BoundingBox3f right_bboxes[BVH_NUM_BINS];
+        uint32_t right_counts[BVH_NUM_BINS];
+        BoundingBox3f right_bbox;
+        uint32_t right_count = 0;
+        for (uint32_t i = BVH_NUM_BINS - 1; i > 0; i--) {
+            right_bbox.expandBy(bins.bboxes[axis][i]);
+            right_count += bins.counts[axis][i];
+            right_bboxes[i] = right_bbox;
+            right_counts[i] = right_count;
+        }
+
+        // sweep from the left, a split after bin i - 1 puts bins [0, i) to the left
+        BoundingBox3f left_bbox;
+        uint32_t left_count = 0;
+        for (uint32_t i = 1; i < BVH_NUM_BINS; i++) {
+            left_bbox.expandBy(bins.bboxes[axis][i - 1]);
+            left_count += bins.counts[axis][i - 1];
+            if (left_count == 0 || right_counts[i] == 0)
+                continue;
+            float cost = left_bbox.getSurfaceArea() * intersectionCost(left_count) +
+                         right_bboxes[i].getSurfaceArea() * intersectionCost(right_counts[i]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = i;
+                split.left_bbox = left_bbox;
+                split.right_bbox = right_bboxes[i];
+                split.left_count = left_count;
+                split.right_count = right_counts[i];
+            }
+        }
     }
 
-    // search through all triangles in node
-    for (uint32_t i = 0; i < node.num_triangles; ++i) {
-        float u, v, t;
-        uint32_t triangle_idx = node.triangle_indices[i];
-        uint32_t mesh_idx = node.mesh_indices[i];
-        if (m_meshes[mesh_idx]->rayIntersect(triangle_idx, ray, u, v, t) && t < ray.maxt) {
-            /* An intersection was found! Can terminate
-               immediately if this is a shadow ray query */
-            if (shadowRay)
-                return true;
-            ray.maxt = t;
-            its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = m_meshes[mesh_idx];
-            hit_idx = triangle_idx;
-            foundIntersection = true;
-        }
-    }
-
-    if (node.child) {
-        std::pair<Node*, float> children[8];
-        Node* current_child = node.child;
-        int i = 0;
-        do {
-            children[i] = std::pair<Node*, float>(current_child, current_child->bbox.distanceTo(ray.o));
-            current_child = current_child->next;
-            i++;
-        } while (current_child);
-
-        std::sort(children, children + 8, [ray](const std::pair<Node*, float>& l, const std::pair<Node*, float>& r) {
-            return l.second < r.second;
-        });
+    if (split.axis >= 0) {
+        split.bin_min = centroid_bbox.min[split.axis];
+        split.bin_factor = bin_factors[split.axis];
+    }
+    return split;
+}
 
-        for (auto child: children) {
-            foundIntersection = traverseRecursive(*child.first, ray, its, shadowRay, hit_idx) || foundIntersection;
-            if (shadowRay && foundIntersection)
-                return true;
+Accel::BVHSplit Accel::findSpatialSplit(const BVHPrimitive* primitives, uint32_t num_primitives,
+        const BoundingBox3f& bbox, bool parallel) const {
+    Vector3f bin_widths = bbox.getExtents() / (float) BVH_NUM_BINS;
+    auto bin_index = [&](float value, int axis) {
+        return std::min((uint32_t) std::max((value - bbox.min[axis]) / bin_widths[axis], 0.f), BVH_NUM_BINS - 1);
+    };
+
+    /* Chop every triangle into the bins it spans, the bins store the bounds of
+       the clipped pieces and how many triangles start and end in them */
+    auto compute_bins = [&](const tbb::blocked_range<uint32_t>& range, SpatialBins bins) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (bin_widths[axis] <= 0.f)
+                    continue;
+                uint32_t first_bin = bin_index(primitives[i].bbox.min[axis], axis);
+                uint32_t last_bin = bin_index(primitives[i].bbox.max[axis], axis);
+                BVHPrimitive rest = primitives[i];
+                for (uint32_t bin = first_bin; bin < last_bin; bin++) {
+                    BoundingBox3f left, right;
+                    splitPrimitive(rest, axis, bbox.min[axis] + bin_widths[axis] * (bin + 1), left, right);
+                    bins.bboxes[axis][bin].expandBy(left);
+                    rest.bbox = right;
+                }
+                bins.bboxes[axis][last_bin].expandBy(rest.bbox);
+                bins.entry_counts[axis][first_bin]++;
+                bins.exit_counts[axis][last_bin]++;
+            }
+        }
+        return bins;
+    };
+    tbb::blocked_range<uint32_t> primitive_range(0, num_primitives, PARALLEL_BUILD_GRAIN_SIZE);
+    SpatialBins bins = parallel
+        ? tbb::parallel_reduce(primitive_range, SpatialBins(), compute_bins, SpatialBins::merge)
+        : compute_bins(primitive_range, SpatialBins());
+
+    BVHSplit split;
+    split.spatial = true;
+    for (int axis = 0; axis < 3; axis++) {
+        if (bin_widths[axis] <= 0.f)
+            continue;
+
+        BoundingBox3f right_bboxes[BVH_NUM_BINS];
+        uint32_t right_counts[BVH_NUM_BINS];
+        BoundingBox3f right_bbox;
+        uint32_t right_count = 0;
+        for (uint32_t i = BVH_NUM_BINS - 1; i > 0; i--) {
+            right_bbox.expandBy(bins.bboxes[axis][i]);
+            right_count += bins.exit_counts[axis][i];
+            right_bboxes[i] = right_bbox;
+            right_counts[i] = right_count;
+        }
+
+        BoundingBox3f left_bbox;
+        uint32_t left_count = 0;
+        for (uint32_t i = 1; i < BVH_NUM_BINS; i++) {
+            left_bbox.expandBy(bins.bboxes[axis][i - 1]);
+            left_count += bins.entry_counts[axis][i - 1];
+            if (left_count == 0 || right_counts[i] == 0)
+                continue;
+            float cost = left_bbox.getSurfaceArea() * intersectionCost(left_count) +
+                         right_bboxes[i].getSurfaceArea() * intersectionCost(right_counts[i]);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.position = bbox.min[axis] + bin_widths[axis] * i;
+                split.left_bbox = left_bbox;
+                split.right_bbox = right_bboxes[i];
+                split.left_count = left_count;
+                split.right_count = right_counts[i];
+            }
         }
     }
-    return foundIntersection;
+    return split;
+}
+
+void Accel::splitPrimitive(const BVHPrimitive& primitive, int axis, float position,
+        BoundingBox3f& left, BoundingBox3f& right) const {
+    const Mesh* mesh = m_meshes[primitive.mesh_idx];
+    const MeshMatrixXf& V = mesh->getVertexPositions();
+
+    // walk along the edges and add the vertices and the crossings of the plane to both sides
+    left.reset();
+    right.reset();
+    for (int i = 0; i < 3; i++) {
+        Point3f a = V.col(mesh->getVertexIndex(primitive.triangle_idx, i));
+        Point3f b = V.col(mesh->getVertexIndex(primitive.triangle_idx, (i + 1) % 3));
+        if (a[axis] <= position)
+            left.expandBy(a);
+        if (a[axis] >= position)
+            right.expandBy(a);
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+            Point3f crossing = a + (b - a) * ((position - a[axis]) / (b[axis] - a[axis]));
+            crossing[axis] = position;
+            left.expandBy(crossing);
+            right.expandBy(crossing);
+        }
+    }
+
+    // the primitive may already be a clipped piece of the triangle
+    left.clip(primitive.bbox);
+    right.clip(primitive.bbox);
+}
+
+Accel::Node* Accel::buildSBVHRecursive(std::vector<BVHPrimitive>& primitives, uint32_t recursion_depth,
+        float root_area, uint32_t split_budget) {
+    uint32_t num_primitives = (uint32_t) primitives.size();
+    bool parallel = num_primitives >= PARALLEL_BUILD_THRESHOLD;
+
+    tbb::blocked_range<uint32_t> primitive_range(0, num_primitives, PARALLEL_BUILD_GRAIN_SIZE);
+
+    auto compute_bounds = [&](const tbb::blocked_range<uint32_t>& range, BVHBounds bounds) {
+        for (uint32_t i = range.begin(); i < range.end(); i++) {
+            bounds.bbox.expandBy(primitives[i].bbox);
+            bounds.centroid_bbox.expandBy(primitives[i].centroid);
+        }
+        return bounds;
+    };
+    BVHBounds bounds = parallel
+        ? tbb::parallel_reduce(primitive_range, BVHBounds(), compute_bounds, BVHBounds::merge)
+        : compute_bounds(primitive_range, BVHBounds());
+    const BoundingBox3f& bbox = bounds.bbox;
+
+    float leaf_cost = intersectionCost(num_primitives);
+    if (num_primitives <= 1 || recursion_depth >= BVH_MAX_DEPTH)
+        return createLeaf(bbox, primitives.data(), num_primitives);
+
+    BVHSplit object_split = findObjectSplit(primitives.data(), num_primitives, bounds.centroid_bbox, parallel);
+
+    /* Spatial splits only pay off where the children of the object split
+       overlap considerably, and only while there is budget for the
+       references they duplicate */
+    BVHSplit split = object_split;
+    BoundingBox3f overlap = object_split.left_bbox;
+    overlap.clip(object_split.right_bbox);
+    bool overlapping = object_split.axis < 0 ||
+        (overlap.isValid() && overlap.getSurfaceArea() > SBVH_OVERLAP_THRESHOLD * root_area);
+    if (overlapping && split_budget > 0) {
+        BVHSplit spatial_split = findSpatialSplit(primitives.data(), num_primitives, bbox, parallel);
+        if (spatial_split.cost < split.cost)
+            split = spatial_split;
+    }
+
+    float split_cost = BVH_TRAVERSAL_COST + split.cost / bbox.getSurfaceArea();
+    if ((split.axis < 0 || leaf_cost <= split_cost) && num_primitives <= MAX_TRIANGLES_PER_NODE)
+        return createLeaf(bbox, primitives.data(), num_primitives);
+
+    std::vector<BVHPrimitive> left, right;
+    if (split.spatial) {
+        /* Triangles that straddle the plane are clipped into both children,
+           unless moving all of them to one side is cheaper (reference unsplitting) */
+        float left_area = split.left_bbox.getSurfaceArea(), right_area = split.right_bbox.getSurfaceArea();
+        float left_cost = intersectionCost(split.left_count), right_cost = intersectionCost(split.right_count);
+        float duplicate_cost = left_area * left_cost + right_area * right_cost;
+        std::vector<BVHPrimitive> straddling_left, straddling_right;
+        for (const BVHPrimitive& primitive : primitives) {
+            int axis = split.axis;
+            if (primitive.bbox.max[axis] <= split.position) {
+                left.push_back(primitive);
+            } else if (primitive.bbox.min[axis] >= split.position) {
+                right.push_back(primitive);
+            } else {
+                BoundingBox3f grown_left = split.left_bbox, grown_right = split.right_bbox;
+                grown_left.expandBy(primitive.bbox);
+                grown_right.expandBy(primitive.bbox);
+                float all_left_cost = grown_left.getSurfaceArea() * left_cost +
+                                      right_area * intersectionCost(split.right_count - 1);
+                float all_right_cost = left_area * intersectionCost(split.left_count - 1) +
+                                       grown_right.getSurfaceArea() * right_cost;
+                if (all_left_cost < duplicate_cost && all_left_cost <= all_right_cost) {
+                    left.push_back(primitive);
+                } else if (all_right_cost < duplicate_cost) {
+                    right.push_back(primitive);
+                } else {
+                    BVHPrimitive left_piece = primitive, right_piece = primitive;
+                    splitPrimitive(primitive, axis, split.position, left_piece.bbox, right_piece.bbox);
+                    // the triangle may only touch the plane within the box of the primitive
+                    if (!left_piece.bbox.isValid()) {
+                        right.push_back(primitive);
+                        continue;
+                    } else if (!right_piece.bbox.isValid()) {
+                        left.push_back(primitive);
+                        continue;
+                    }
+                    left_piece.centroid = left_piece.bbox.getCenter();
+                    right_piece.centroid = right_piece.bbox.getCenter();
+                    straddling_left.push_back(left_piece);
+                    straddling_right.push_back(right_piece);
+                }
+            }
+        }
+
+        uint32_t num_duplicates = (uint32_t) straddling_left.size();
+        if (num_duplicates <= split_budget && left.size() + num_duplicates > 0 && right.size() + num_duplicates > 0) {
+            left.insert(left.end(), straddling_left.begin(), straddling_left.end());
+            right.insert(right.end(), straddling_right.begin(), straddling_right.end());
+            split_budget -= num_duplicates;
+        } else {
+            // over budget, use the object split after all
+            split = object_split;
+            left.clear();
+            right.clear();
+        }
+    }
+
+    if (!split.spatial) {
+        if (split.axis >= 0) {
+            for (const BVHPrimitive& primitive : primitives)
+                (split.isLeft(primitive) ? left : right).push_back(primitive);
+        } else {
+            // too many identical centroids for a single leaf, fall back to splitting the list in half
+            left.assign(primitives.begin(), primitives.begin() + num_primitives / 2);
+            right.assign(primitives.begin() + num_primitives / 2, primitives.end());
+        }
+    }
+    primitives = std::vector<BVHPrimitive>();
+
+    /* The remaining budget is shared by the children in proportion to their
+       size, so that it is not used up by whichever subtree is built first */
+    uint32_t left_budget = (uint32_t) ((uint64_t) split_budget * left.size() / (left.size() + right.size()));
+    uint32_t right_budget = split_budget - left_budget;
+
+    Node* node = new Node();
+    node->bbox = bbox;
+    node->axis = split.axis >= 0 ? split.axis : bounds.centroid_bbox.getLargestAxis();
+
+    Node* left_child;
+    Node* right_child;
+    auto build_left = [&] {
+        left_child = buildSBVHRecursive(left, recursion_depth + 1, root_area, left_budget);
+    };
+    auto build_right = [&] {
+        right_child = buildSBVHRecursive(right, recursion_depth + 1, root_area, right_budget);
+    };
+    if (parallel) {
+        tbb::parallel_invoke(build_left, build_right);
+    } else {
+        build_left();
+        build_right();
+    }
+    node->child = left_child;
+    left_child->next = right_child;
+    return node;
+}
+
+Accel::Node* Accel::createLeaf(const BoundingBox3f& bbox, const BVHPrimitive* primitives, uint32_t num_primitives) {
+    Node* node = new Node();
+    node->bbox = bbox;
+    node->num_triangles = num_primitives;
+    node->triangle_indices = new uint32_t[num_primitives];
+    node->mesh_indices = new uint32_t[num_primitives];
+    for (uint32_t i = 0; i < num_primitives; i++) {
+        node->triangle_indices[i] = primitives[i].triangle_idx;
+        node->mesh_indices[i] = primitives[i].mesh_idx;
+    }
+    return node;
 }
 
 void Accel::subdivideBBox(const nori::BoundingBox3f &parent, nori::BoundingBox3f *bboxes) {
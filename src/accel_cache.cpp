@@ -0,0 +1,329 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     On-disk cache of the flattened hierarchies (see Accel::setCacheFile()).
+
+     The file starts with a fixed size header followed by the raw arrays
+     used for traversal, every array starts at a multiple of
+     CACHE_ALIGNMENT bytes so that the file can be mapped into memory
+     as it is. The header stores a key that hashes everything the build
+     depends on: the mesh geometry, the instance transformations, the
+     build settings and the format version. A cache with a different key
+     is ignored and overwritten after the rebuild.
+ * ======================================================================= */
+
+#include <nori/accel.h>
+#include <tbb/parallel_for.h>
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <cstdio>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+static constexpr char     CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'A', 'C', 'C', '\0' };
+static constexpr uint32_t CACHE_VERSION = 2;   ///< Increase whenever the layout of the cached data changes
+static constexpr uint64_t CACHE_ALIGNMENT = 64;
+
+/// Arrays stored in the cache file, in file order
+enum ECacheSection {
+    ECacheNodes = 0,
+    ECacheNodes16,
+    ECacheNodes8,
+    ECacheGroupRoots,
+    ECacheGroupBBoxes,
+    ECacheTriangleRefs,
+    ECacheMeshRefs,
+    ECacheInstanceRefs,
+    ECacheTrianglePackets,
+    ECacheSectionCount
+};
+
+struct CacheSection {
+    uint64_t offset; ///< Position in the file in bytes
+    uint64_t size;   ///< Size in bytes
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;     ///< Guards against a different struct layout
+    uint64_t key;
+    uint32_t num_nodes;
+    uint32_t num_leaf_nodes;
+    uint32_t num_nonempty_leaf_nodes;
+    uint32_t num_triangles_saved;
+    uint32_t recursion_depth;
+    float sah_cost;
+    float top_level_bbox[6];
+    CacheSection sections[ECacheSectionCount];
+};
+
+/// Mix a 64 bit value into a hash (MurmurHash3 style)
+static inline uint64_t hashCombine(uint64_t hash, uint64_t value) {
+    value *= 0x87c37b91114253d5ull;
+    value = (value << 31) | (value >> 33);
+    value *= 0x4cf5ad432745937full;
+    hash ^= value;
+    hash = (hash << 27) | (hash >> 37);
+    return hash * 5 + 0x52dce729;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash = hashCombine(hash, word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    return hashCombine(hash, tail ^ ((uint64_t) size << 56));
+}
+
+template <typename Matrix> static uint64_t hashMatrix(uint64_t hash, const Matrix& matrix) {
+    hash = hashCombine(hash, ((uint64_t) matrix.rows() << 32) | (uint64_t) matrix.cols());
+    return hashBytes(hash, matrix.data(), matrix.size() * sizeof(typename Matrix::Scalar));
+}
+
+template <typename Vector> static void writeSection(std::ofstream& out, const Vector& data, CacheSection& section) {
+    static const char padding[CACHE_ALIGNMENT] = { };
+    uint64_t offset = (uint64_t) out.tellp();
+    uint64_t aligned = (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+    out.write(padding, (std::streamsize) (aligned - offset));
+    section.offset = aligned;
+    section.size = data.size() * sizeof(typename Vector::value_type);
+    out.write(reinterpret_cast<const char*>(data.data()), (std::streamsize) section.size);
+}
+
+template <typename Vector> static bool readSection(std::ifstream& in, uint64_t file_size, const CacheSection& section,
+        Vector& data) {
+    if (section.size % sizeof(typename Vector::value_type) != 0 || section.offset % CACHE_ALIGNMENT != 0 ||
+            section.offset > file_size || section.size > file_size - section.offset)
+        return false;
+    data.resize(section.size / sizeof(typename Vector::value_type));
+    in.seekg((std::streamoff) section.offset);
+    in.read(reinterpret_cast<char*>(data.data()), (std::streamsize) section.size);
+    return (bool) in;
+}
+
+/**
+ * Check that the nodes only reference nodes, instances and triangles that
+ * exist. Children are always stored behind their parent, which rules out
+ * cycles, and the traversal stacks must be able to hold the tree.
+ */
+template <typename Nodes> static bool validateNodes(const Nodes& nodes, const std::vector<uint32_t>& group_roots,
+        size_t num_instance_refs, size_t num_triangle_refs) {
+    size_t num_nodes = nodes.size();
+    size_t num_top_level_nodes = group_roots.empty() ? num_nodes : group_roots[0];
+    if (num_nodes == 0 || num_top_level_nodes == 0 || num_top_level_nodes > num_nodes)
+        return false;
+    for (size_t i = 0; i < group_roots.size(); i++)
+        if (group_roots[i] < num_top_level_nodes || group_roots[i] >= num_nodes)
+            return false;
+
+    // largest number of entries on the stack while a node is visited
+    std::vector<uint32_t> stack_size(num_nodes, 0);
+    stack_size[0] = 1;
+    for (uint32_t root : group_roots)
+        stack_size[root] = 1;
+    for (size_t i = 0; i < num_nodes; i++) {
+        bool top_level = i < num_top_level_nodes;
+        uint64_t offset = nodes[i].offset;
+        if (nodes[i].num_children == 0) {
+            if (offset + nodes[i].num_triangles > (top_level ? num_instance_refs : num_triangle_refs))
+                return false;
+            continue;
+        }
+        uint64_t end = offset + nodes[i].num_children;
+        if (offset <= i || end > (top_level ? num_top_level_nodes : num_nodes) ||
+                (!top_level && offset < num_top_level_nodes))
+            return false;
+        uint32_t child_stack_size = stack_size[i] + nodes[i].num_children - 1;
+        if (child_stack_size > TRAVERSAL_STACK_SIZE)
+            return false;
+        for (uint64_t child = offset; child < end; child++)
+            stack_size[child] = std::max(stack_size[child], child_stack_size);
+    }
+    return true;
+}
+
+uint64_t Accel::computeCacheKey() const {
+    // the geometry of the meshes dominates, hash it in parallel
+    std::vector<uint64_t> mesh_hashes(m_meshes.size());
+    tbb::parallel_for(size_t(0), m_meshes.size(), [&](size_t i) {
+        uint64_t hash = hashMatrix(0, m_meshes[i]->getVertexPositions());
+        hash = hashMatrix(hash, m_meshes[i]->getIndices());
+        mesh_hashes[i] = hashMatrix(hash, m_meshes[i]->getCompactIndices());
+    });
+
+    uint64_t key = CACHE_VERSION;
+    uint32_t settings[] = { (uint32_t) m_type, (uint32_t) m_node_format, (uint32_t) m_simd_level, (uint32_t) m_watertight,
+                            MAX_TRIANGLES_PER_NODE, MAX_RECURSION_DEPTH, BVH_NUM_BINS, BVH_MAX_DEPTH, SIMD_PACKET_SIZE };
+    float costs[] = { BVH_TRAVERSAL_COST, BVH_INTERSECTION_COST, SBVH_OVERLAP_THRESHOLD, m_split_budget };
+    key = hashBytes(key, settings, sizeof(settings));
+    key = hashBytes(key, costs, sizeof(costs));
+
+    key = hashBytes(key, mesh_hashes.data(), mesh_hashes.size() * sizeof(uint64_t));
+    for (const std::vector<uint32_t>& group : m_groups)
+        key = hashBytes(key, group.data(), group.size() * sizeof(uint32_t));
+    for (const InstanceData& instance : m_instances) {
+        key = hashCombine(key, ((uint64_t) instance.group_idx << 1) | (uint64_t) instance.transformed);
+        key = hashMatrix(key, instance.to_world.getMatrix());
+    }
+    return key;
+}
+
+bool Accel::loadCache(uint64_t key) {
+    std::ifstream in(m_cache_file, std::ios::binary);
+    if (!in)
+        return false;
+    in.seekg(0, std::ios::end);
+    uint64_t file_size = (uint64_t) in.tellg();
+    in.seekg(0);
+
+    CacheHeader header;
+    if (file_size < sizeof(CacheHeader) || !in.read(reinterpret_cast<char*>(&header), sizeof(CacheHeader)) ||
+            memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION ||
+            header.node_size != sizeof(LinearNode)) {
+        printf("Acceleration structure cache \"%s\" has an unknown format, rebuilding \n", m_cache_file.c_str());
+        return false;
+    }
+    if (header.key != key) {
+        printf("Acceleration structure cache \"%s\" is outdated, rebuilding \n", m_cache_file.c_str());
+        return false;
+    }
+
+    const CacheSection* sections = header.sections;
+    bool valid = readSection(in, file_size, sections[ECacheNodes], m_nodes) &&
+                 readSection(in, file_size, sections[ECacheNodes16], m_nodes16) &&
+                 readSection(in, file_size, sections[ECacheNodes8], m_nodes8) &&
+                 readSection(in, file_size, sections[ECacheGroupRoots], m_group_roots) &&
+                 readSection(in, file_size, sections[ECacheGroupBBoxes], m_group_bboxes) &&
+                 readSection(in, file_size, sections[ECacheTriangleRefs], m_triangle_refs) &&
+                 readSection(in, file_size, sections[ECacheMeshRefs], m_mesh_refs) &&
+                 readSection(in, file_size, sections[ECacheInstanceRefs], m_instance_refs) &&
+                 readSection(in, file_size, sections[ECacheTrianglePackets], m_triangle_packets);
+    valid = valid && m_group_roots.size() == m_groups.size() && m_group_bboxes.size() == m_groups.size();
+
+    // a damaged file must not make the traversal read outside of the buffers
+    if (valid) {
+        if (m_node_format == EQuantized16)
+            valid = m_nodes.empty() && m_nodes8.empty() &&
+                    validateNodes(m_nodes16, m_group_roots, m_instance_refs.size(), m_triangle_refs.size());
+        else if (m_node_format == EQuantized8)
+            valid = m_nodes.empty() && m_nodes16.empty() &&
+                    validateNodes(m_nodes8, m_group_roots, m_instance_refs.size(), m_triangle_refs.size());
+        else
+            valid = m_nodes16.empty() && m_nodes8.empty() &&
+                    validateNodes(m_nodes, m_group_roots, m_instance_refs.size(), m_triangle_refs.size());
+    }
+    valid = valid && m_mesh_refs.size() == m_triangle_refs.size() &&
+            m_triangle_packets.size() == (m_triangle_refs.size() + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE;
+    for (size_t i = 0; valid && i < m_triangle_refs.size(); i++)
+        valid = m_mesh_refs[i] < m_meshes.size() && m_triangle_refs[i] < m_meshes[m_mesh_refs[i]]->getTriangleCount();
+    for (size_t i = 0; valid && i < m_instance_refs.size(); i++)
+        valid = m_instance_refs[i] < m_instances.size();
+
+    if (!valid) {
+        printf("Acceleration structure cache \"%s\" is corrupt, rebuilding \n", m_cache_file.c_str());
+        clear();
+        return false;
+    }
+
+    m_num_nodes = header.num_nodes;
+    m_num_leaf_nodes = header.num_leaf_nodes;
+    m_num_nonempty_leaf_nodes = header.num_nonempty_leaf_nodes;
+    m_num_triangles_saved = header.num_triangles_saved;
+    m_recursion_depth = header.recursion_depth;
+    m_sah_cost = header.sah_cost;
+    m_top_level_bbox.min = Point3f(header.top_level_bbox[0], header.top_level_bbox[1], header.top_level_bbox[2]);
+    m_top_level_bbox.max = Point3f(header.top_level_bbox[3], header.top_level_bbox[4], header.top_level_bbox[5]);
+    return true;
+}
+
+bool Accel::saveCache(uint64_t key) const {
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.node_size = sizeof(LinearNode);
+    header.key = key;
+    header.num_nodes = m_num_nodes;
+    header.num_leaf_nodes = m_num_leaf_nodes;
+    header.num_nonempty_leaf_nodes = m_num_nonempty_leaf_nodes;
+    header.num_triangles_saved = m_num_triangles_saved;
+    header.recursion_depth = m_recursion_depth;
+    header.sah_cost = m_sah_cost;
+    for (int i = 0; i < 3; i++) {
+        header.top_level_bbox[i] = m_top_level_bbox.min[i];
+        header.top_level_bbox[i + 3] = m_top_level_bbox.max[i];
+    }
+
+    /* Write to a temporary file first, so that concurrent runs never see a
+       partial cache. Its name is unique, every run writes its own file. */
+#if defined(PLATFORM_WINDOWS)
+    uint32_t pid = (uint32_t) GetCurrentProcessId();
+#else
+    uint32_t pid = (uint32_t) getpid();
+#endif
+    std::string temp_file = tfm::format("%s.%u.%08x.tmp", m_cache_file, pid, std::random_device()());
+    std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+    CacheSection* sections = header.sections;
+    writeSection(out, m_nodes, sections[ECacheNodes]);
+    writeSection(out, m_nodes16, sections[ECacheNodes16]);
+    writeSection(out, m_nodes8, sections[ECacheNodes8]);
+    writeSection(out, m_group_roots, sections[ECacheGroupRoots]);
+    writeSection(out, m_group_bboxes, sections[ECacheGroupBBoxes]);
+    writeSection(out, m_triangle_refs, sections[ECacheTriangleRefs]);
+    writeSection(out, m_mesh_refs, sections[ECacheMeshRefs]);
+    writeSection(out, m_instance_refs, sections[ECacheInstanceRefs]);
+    writeSection(out, m_triangle_packets, sections[ECacheTrianglePackets]);
+
+    // the section table is only known now
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+    out.close();
+    if (!out) {
+        std::remove(temp_file.c_str());
+        return false;
+    }
+
+    // replace the old cache atomically, it stays in place if this fails
+#if defined(PLATFORM_WINDOWS)
+    bool renamed = MoveFileExA(temp_file.c_str(), m_cache_file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool renamed = std::rename(temp_file.c_str(), m_cache_file.c_str()) == 0;
+#endif
+    if (!renamed)
+        std::remove(temp_file.c_str());
+    return renamed;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,463 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     SSE and AVX2 versions of the ray-box and ray-triangle tests used by
+     Accel. The AVX2 kernels are compiled with a function level target
+     attribute, so no special compiler flags are needed. Which kernels are
+     used is decided at runtime (see Accel::detectSIMDLevel()).
+ * ======================================================================= */
+
+#include <nori/accel.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define NORI_HAS_SSE 1
+#  include <immintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#    define NORI_TARGET_AVX2
+#  else
+#    define NORI_TARGET_AVX2 __attribute__((target("avx2")))
+#  endif
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+Accel::ESIMDLevel Accel::detectSIMDLevel() {
+#if defined(NORI_HAS_SSE)
+#  if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int num_ids = info[0];
+    __cpuid(info, 1);
+    bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    if (os_avx && num_ids >= 7) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return ESIMDAVX2;
+    }
+#  else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ESIMDAVX2;
+#  endif
+    return ESIMDSSE;
+#else
+    return ESIMDNone;
+#endif
+}
+
+#if defined(NORI_HAS_SSE)
+
+static_assert(sizeof(BoundingBox3f) == 6 * sizeof(float), "The SIMD kernels expect a tightly packed bounding box");
+
+/**
+ * Load the bounding boxes of up to four consecutive nodes and transpose them
+ * into SoA form: min x, min y, min z, max x, max y, max z. Missing nodes
+ * repeat the last valid one.
+ */
+template <typename NodeType> static inline void loadBoxes4(const NodeType* nodes, uint32_t count, __m128* bounds) {
+    const float* p0 = reinterpret_cast<const float*>(&nodes[0]);
+    const float* p1 = reinterpret_cast<const float*>(&nodes[std::min(1u, count - 1)]);
+    const float* p2 = reinterpret_cast<const float*>(&nodes[std::min(2u, count - 1)]);
+    const float* p3 = reinterpret_cast<const float*>(&nodes[std::min(3u, count - 1)]);
+
+    __m128 r0 = _mm_load_ps(p0), r1 = _mm_load_ps(p1), r2 = _mm_load_ps(p2), r3 = _mm_load_ps(p3);
+    __m128 s0 = _mm_load_ps(p0 + 4), s1 = _mm_load_ps(p1 + 4), s2 = _mm_load_ps(p2 + 4), s3 = _mm_load_ps(p3 + 4);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+
+    bounds[0] = r0; bounds[1] = r1; bounds[2] = r2;
+    bounds[3] = r3; bounds[4] = s0; bounds[5] = s1;
+}
+
+/// Slab test of a ray against four boxes, returns the hit mask
+static inline int intersectBoxes4(const __m128* bounds, const __m128* o, const __m128* rcp,
+        __m128 mint, __m128 maxt, __m128& near_t) {
+    const __m128 far_scale = _mm_set1_ps(BOX_FAR_SCALE);
+    __m128 near = mint, far = maxt;
+    for (int axis = 0; axis < 3; axis++) {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(bounds[axis], o[axis]), rcp[axis]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(bounds[axis + 3], o[axis]), rcp[axis]);
+        near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+        far = _mm_min_ps(far, _mm_mul_ps(_mm_max_ps(t0, t1), far_scale));
+    }
+    near_t = near;
+    return _mm_movemask_ps(_mm_cmple_ps(near, far));
+}
+
+/**
+ * Moeller-Trumbore test of a ray against the four triangles of a packet, same
+ * conventions as Mesh::rayIntersect(). Returns the mask of lanes with a valid
+ * hit in [mint, maxt).
+ */
+static inline int intersectPacket4(const float* v0, const float* edge1, const float* edge2,
+        const __m128* o, const __m128* d, __m128 mint, __m128 maxt, __m128& u, __m128& v, __m128& t) {
+    __m128 e1x = _mm_load_ps(edge1), e1y = _mm_load_ps(edge1 + 4), e1z = _mm_load_ps(edge1 + 8);
+    __m128 e2x = _mm_load_ps(edge2), e2y = _mm_load_ps(edge2 + 4), e2z = _mm_load_ps(edge2 + 8);
+
+    /* Begin calculating determinant - also used to calculate U parameter */
+    __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(d[2], e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(d[0], e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(d[1], e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+    /* Calculate distance from v[0] to ray origin */
+    __m128 tx = _mm_sub_ps(o[0], _mm_load_ps(v0));
+    __m128 ty = _mm_sub_ps(o[1], _mm_load_ps(v0 + 4));
+    __m128 tz = _mm_sub_ps(o[2], _mm_load_ps(v0 + 8));
+    u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+    /* Prepare to test V parameter */
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), inv_det);
+    t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), eps = _mm_set1_ps(1e-8f);
+    __m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(zero, eps)), _mm_cmpge_ps(det, eps));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, mint), _mm_cmplt_ps(t, maxt)));
+    return _mm_movemask_ps(valid);
+}
+
+/**
+ * Watertight test of a ray against the four triangles of a packet that stores
+ * the three vertices, see Accel::intersectTriangleWatertight(). \c k holds the
+ * permuted axes of the ray space, \c o the ray origin in this order and
+ * \c shear the shear constants.
+ */
+static inline int intersectPacket4Watertight(const float* v0, const float* v1, const float* v2, const int* k,
+        const __m128* o, const __m128* shear, __m128 mint, __m128 maxt, __m128& u, __m128& v, __m128& t) {
+    const int kx = k[0] * 4, ky = k[1] * 4, kz = k[2] * 4;
+
+    /* Vertices relative to the ray origin, sheared in x and y */
+    __m128 az = _mm_sub_ps(_mm_load_ps(v0 + kz), o[2]);
+    __m128 bz = _mm_sub_ps(_mm_load_ps(v1 + kz), o[2]);
+    __m128 cz = _mm_sub_ps(_mm_load_ps(v2 + kz), o[2]);
+    __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v0 + kx), o[0]), _mm_mul_ps(shear[0], az));
+    __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v0 + ky), o[1]), _mm_mul_ps(shear[1], az));
+    __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v1 + kx), o[0]), _mm_mul_ps(shear[0], bz));
+    __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v1 + ky), o[1]), _mm_mul_ps(shear[1], bz));
+    __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v2 + kx), o[0]), _mm_mul_ps(shear[0], cz));
+    __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v2 + ky), o[1]), _mm_mul_ps(shear[1], cz));
+
+    /* Scaled barycentric coordinates, all of them must have the same sign */
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+    __m128 zero = _mm_setzero_ps();
+    __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+    __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    __m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+    u = _mm_mul_ps(e1, inv_det);
+    v = _mm_mul_ps(e2, inv_det);
+    __m128 scaled_t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, az), _mm_mul_ps(e1, bz)), _mm_mul_ps(e2, cz));
+    t = _mm_mul_ps(_mm_mul_ps(shear[2], scaled_t), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, mint), _mm_cmplt_ps(t, maxt)));
+    return _mm_movemask_ps(valid);
+}
+
+/// Pick the closest lane of a hit mask and update the output values
+static inline int closestLane(int mask, int width, const float* lane_u, const float* lane_v, const float* lane_t,
+        float& maxt, float& u, float& v, float& t) {
+    int best = -1;
+    for (int lane = 0; lane < width; lane++) {
+        if ((mask & (1 << lane)) && lane_t[lane] < maxt) {
+            maxt = t = lane_t[lane];
+            u = lane_u[lane];
+            v = lane_v[lane];
+            best = lane;
+        }
+    }
+    return best;
+}
+
+uint32_t Accel::intersectChildrenSSE(const LinearNode* children, uint32_t num_children, const SIMDRay& ray,
+        float maxt, float* near_t) {
+    const __m128 o[3] = { _mm_set1_ps(ray.o[0]), _mm_set1_ps(ray.o[1]), _mm_set1_ps(ray.o[2]) };
+    const __m128 rcp[3] = { _mm_set1_ps(ray.dRcp[0]), _mm_set1_ps(ray.dRcp[1]), _mm_set1_ps(ray.dRcp[2]) };
+    const __m128 mint = _mm_set1_ps(ray.mint), maxt4 = _mm_set1_ps(maxt);
+
+    uint32_t hit_mask = 0;
+    for (uint32_t i = 0; i < num_children; i += 4) {
+        uint32_t count = std::min(4u, num_children - i);
+        __m128 bounds[6], near;
+        loadBoxes4(children + i, count, bounds);
+        uint32_t mask = (uint32_t) intersectBoxes4(bounds, o, rcp, mint, maxt4, near);
+        _mm_storeu_ps(near_t + i, near);
+        hit_mask |= (mask & ((1u << count) - 1)) << i;
+    }
+    return hit_mask;
+}
+
+int Accel::intersectLeafSSE(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const {
+    const __m128 o[3] = { _mm_set1_ps(ray.o[0]), _mm_set1_ps(ray.o[1]), _mm_set1_ps(ray.o[2]) };
+    const __m128 d[3] = { _mm_set1_ps(ray.d[0]), _mm_set1_ps(ray.d[1]), _mm_set1_ps(ray.d[2]) };
+    const __m128 shear[3] = { _mm_set1_ps(ray.shear[0]), _mm_set1_ps(ray.shear[1]), _mm_set1_ps(ray.shear[2]) };
+    const __m128 mint = _mm_set1_ps(ray.mint);
+
+    // the watertight test wants the origin in the permuted order of the ray space
+    const __m128 o_permuted[3] = { o[ray.k[0]], o[ray.k[1]], o[ray.k[2]] };
+
+    const TrianglePacket* packets = &m_triangle_packets[node.offset / SIMD_PACKET_SIZE];
+    uint32_t num_packets = (node.num_triangles + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE;
+    int hit = -1;
+    for (uint32_t i = 0; i < num_packets; i++) {
+        const TrianglePacket& packet = packets[i];
+        __m128 lane_u, lane_v, lane_t;
+        int mask = m_watertight
+            ? intersectPacket4Watertight(packet.v0[0], packet.edge1[0], packet.edge2[0], ray.k, o_permuted, shear,
+                                         mint, _mm_set1_ps(maxt), lane_u, lane_v, lane_t)
+            : intersectPacket4(packet.v0[0], packet.edge1[0], packet.edge2[0],
+                               o, d, mint, _mm_set1_ps(maxt), lane_u, lane_v, lane_t);
+        if (!mask)
+            continue;
+
+        alignas(16) float us[4], vs[4], ts[4];
+        _mm_store_ps(us, lane_u);
+        _mm_store_ps(vs, lane_v);
+        _mm_store_ps(ts, lane_t);
+        int lane = closestLane(mask, 4, us, vs, ts, maxt, u, v, t);
+        if (lane >= 0)
+            hit = (int) (i * SIMD_PACKET_SIZE) + lane;
+    }
+    return hit;
+}
+
+uint32_t Accel::intersectNodePacketSSE(const LinearNode& node, const RayPacket& rays, uint32_t count) {
+    const float* bounds = reinterpret_cast<const float*>(&node.bbox);
+    const __m128 far_scale = _mm_set1_ps(BOX_FAR_SCALE);
+    uint32_t hit_mask = 0;
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128 near = _mm_load_ps(rays.mint + i), far = _mm_load_ps(rays.maxt + i);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 o = _mm_load_ps(rays.o[axis] + i), rcp = _mm_load_ps(rays.dRcp[axis] + i);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[axis]), o), rcp);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[axis + 3]), o), rcp);
+            near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+            far = _mm_min_ps(far, _mm_mul_ps(_mm_max_ps(t0, t1), far_scale));
+        }
+        hit_mask |= (uint32_t) _mm_movemask_ps(_mm_cmple_ps(near, far)) << i;
+    }
+    return hit_mask;
+}
+
+/// Combine two SSE registers into one AVX register
+NORI_TARGET_AVX2 static inline __m256 combine(__m128 lo, __m128 hi) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+/// Load the same row of two consecutive triangle packets, \c stride is the packet size in floats
+NORI_TARGET_AVX2 static inline __m256 loadPacketPair(const float* row, size_t stride) {
+    return combine(_mm_load_ps(row), _mm_load_ps(row + stride));
+}
+
+NORI_TARGET_AVX2 uint32_t Accel::intersectChildrenAVX2(const LinearNode* children, uint32_t num_children, const SIMDRay& ray,
+        float maxt, float* near_t) {
+    // BVH nodes only have two children, a single SSE test covers them
+    if (num_children != 8)
+        return intersectChildrenSSE(children, num_children, ray, maxt, near_t);
+
+    __m128 lo[6], hi[6];
+    loadBoxes4(children, 4, lo);
+    loadBoxes4(children + 4, 4, hi);
+
+    const __m256 far_scale = _mm256_set1_ps(BOX_FAR_SCALE);
+    __m256 near = _mm256_set1_ps(ray.mint), far = _mm256_set1_ps(maxt);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256 o = _mm256_set1_ps(ray.o[axis]), rcp = _mm256_set1_ps(ray.dRcp[axis]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(combine(lo[axis], hi[axis]), o), rcp);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(combine(lo[axis + 3], hi[axis + 3]), o), rcp);
+        near = _mm256_max_ps(near, _mm256_min_ps(t0, t1));
+        far = _mm256_min_ps(far, _mm256_mul_ps(_mm256_max_ps(t0, t1), far_scale));
+    }
+    _mm256_storeu_ps(near_t, near);
+    return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ));
+}
+
+NORI_TARGET_AVX2 uint32_t Accel::intersectNodePacketAVX2(const LinearNode& node, const RayPacket& rays, uint32_t count) {
+    const float* bounds = reinterpret_cast<const float*>(&node.bbox);
+    const __m256 far_scale = _mm256_set1_ps(BOX_FAR_SCALE);
+    uint32_t hit_mask = 0;
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256 near = _mm256_load_ps(rays.mint + i), far = _mm256_load_ps(rays.maxt + i);
+        for (int axis = 0; axis < 3; axis++) {
+            __m256 o = _mm256_load_ps(rays.o[axis] + i), rcp = _mm256_load_ps(rays.dRcp[axis] + i);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[axis]), o), rcp);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[axis + 3]), o), rcp);
+            near = _mm256_max_ps(near, _mm256_min_ps(t0, t1));
+            far = _mm256_min_ps(far, _mm256_mul_ps(_mm256_max_ps(t0, t1), far_scale));
+        }
+        hit_mask |= (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ)) << i;
+    }
+    return hit_mask;
+}
+
+/// Moeller-Trumbore test of a ray against the eight triangles of two consecutive packets, see intersectPacket4()
+NORI_TARGET_AVX2 static inline int intersectPacket8(const float* v0, const float* edge1, const float* edge2, size_t stride,
+        const __m256* o, const __m256* d, __m256 mint, __m256 maxt, __m256& u, __m256& v, __m256& t) {
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 eps = _mm256_set1_ps(1e-8f), neg_eps = _mm256_set1_ps(-1e-8f);
+
+    __m256 e1x = loadPacketPair(edge1, stride), e1y = loadPacketPair(edge1 + 4, stride), e1z = loadPacketPair(edge1 + 8, stride);
+    __m256 e2x = loadPacketPair(edge2, stride), e2y = loadPacketPair(edge2 + 4, stride), e2z = loadPacketPair(edge2 + 8, stride);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2z), _mm256_mul_ps(d[2], e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2x), _mm256_mul_ps(d[0], e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2y), _mm256_mul_ps(d[1], e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 inv_det = _mm256_div_ps(one, det);
+
+    __m256 tx = _mm256_sub_ps(o[0], loadPacketPair(v0, stride));
+    __m256 ty = _mm256_sub_ps(o[1], loadPacketPair(v0 + 4, stride));
+    __m256 tz = _mm256_sub_ps(o[2], loadPacketPair(v0 + 8, stride));
+    u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)), _mm256_mul_ps(d[2], qz)), inv_det);
+    t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+    __m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, neg_eps, _CMP_LE_OQ), _mm256_cmp_ps(det, eps, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, mint, _CMP_GE_OQ), _mm256_cmp_ps(t, maxt, _CMP_LT_OQ)));
+    return _mm256_movemask_ps(valid);
+}
+
+/// Watertight test of a ray against the eight triangles of two consecutive packets, see intersectPacket4Watertight()
+NORI_TARGET_AVX2 static inline int intersectPacket8Watertight(const float* v0, const float* v1, const float* v2, size_t stride,
+        const int* k, const __m256* o, const __m256* shear, __m256 mint, __m256 maxt, __m256& u, __m256& v, __m256& t) {
+    const int kx = k[0] * 4, ky = k[1] * 4, kz = k[2] * 4;
+
+    __m256 az = _mm256_sub_ps(loadPacketPair(v0 + kz, stride), o[2]);
+    __m256 bz = _mm256_sub_ps(loadPacketPair(v1 + kz, stride), o[2]);
+    __m256 cz = _mm256_sub_ps(loadPacketPair(v2 + kz, stride), o[2]);
+    __m256 ax = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v0 + kx, stride), o[0]), _mm256_mul_ps(shear[0], az));
+    __m256 ay = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v0 + ky, stride), o[1]), _mm256_mul_ps(shear[1], az));
+    __m256 bx = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v1 + kx, stride), o[0]), _mm256_mul_ps(shear[0], bz));
+    __m256 by = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v1 + ky, stride), o[1]), _mm256_mul_ps(shear[1], bz));
+    __m256 cx = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v2 + kx, stride), o[0]), _mm256_mul_ps(shear[0], cz));
+    __m256 cy = _mm256_sub_ps(_mm256_sub_ps(loadPacketPair(v2 + ky, stride), o[1]), _mm256_mul_ps(shear[1], cz));
+
+    __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ), _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+                                   _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+    __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ), _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+                                   _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 valid = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+    u = _mm256_mul_ps(e1, inv_det);
+    v = _mm256_mul_ps(e2, inv_det);
+    __m256 scaled_t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, az), _mm256_mul_ps(e1, bz)), _mm256_mul_ps(e2, cz));
+    t = _mm256_mul_ps(_mm256_mul_ps(shear[2], scaled_t), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, mint, _CMP_GE_OQ), _mm256_cmp_ps(t, maxt, _CMP_LT_OQ)));
+    return _mm256_movemask_ps(valid);
+}
+
+NORI_TARGET_AVX2 int Accel::intersectLeafAVX2(const LinearNode& node, const SIMDRay& ray, float maxt, float& u, float& v, float& t) const {
+    const TrianglePacket* packets = &m_triangle_packets[node.offset / SIMD_PACKET_SIZE];
+    uint32_t num_packets = (node.num_triangles + SIMD_PACKET_SIZE - 1) / SIMD_PACKET_SIZE;
+
+    // a single packet is handled by the SSE kernel
+    if (num_packets == 1)
+        return intersectLeafSSE(node, ray, maxt, u, v, t);
+
+    const __m256 o[3] = { _mm256_set1_ps(ray.o[0]), _mm256_set1_ps(ray.o[1]), _mm256_set1_ps(ray.o[2]) };
+    const __m256 d[3] = { _mm256_set1_ps(ray.d[0]), _mm256_set1_ps(ray.d[1]), _mm256_set1_ps(ray.d[2]) };
+    const __m256 shear[3] = { _mm256_set1_ps(ray.shear[0]), _mm256_set1_ps(ray.shear[1]), _mm256_set1_ps(ray.shear[2]) };
+    const __m256 o_permuted[3] = { o[ray.k[0]], o[ray.k[1]], o[ray.k[2]] };
+    const __m256 mint = _mm256_set1_ps(ray.mint);
+
+    const size_t stride = sizeof(TrianglePacket) / sizeof(float);
+
+    int hit = -1;
+    uint32_t i = 0;
+    for (; i + 1 < num_packets; i += 2) {
+        const TrianglePacket& packet = packets[i];
+        __m256 lane_u, lane_v, lane_t;
+        int mask = m_watertight
+            ? intersectPacket8Watertight(packet.v0[0], packet.edge1[0], packet.edge2[0], stride, ray.k, o_permuted, shear,
+                                         mint, _mm256_set1_ps(maxt), lane_u, lane_v, lane_t)
+            : intersectPacket8(packet.v0[0], packet.edge1[0], packet.edge2[0], stride,
+                               o, d, mint, _mm256_set1_ps(maxt), lane_u, lane_v, lane_t);
+        if (!mask)
+            continue;
+
+        alignas(32) float us[8], vs[8], ts[8];
+        _mm256_store_ps(us, lane_u);
+        _mm256_store_ps(vs, lane_v);
+        _mm256_store_ps(ts, lane_t);
+        int lane = closestLane(mask, 8, us, vs, ts, maxt, u, v, t);
+        if (lane >= 0)
+            hit = (int) (i * SIMD_PACKET_SIZE) + lane;
+    }
+
+    // odd number of packets, test the last one with SSE
+    if (i < num_packets) {
+        const __m128 o4[3] = { _mm_set1_ps(ray.o[0]), _mm_set1_ps(ray.o[1]), _mm_set1_ps(ray.o[2]) };
+        const __m128 d4[3] = { _mm_set1_ps(ray.d[0]), _mm_set1_ps(ray.d[1]), _mm_set1_ps(ray.d[2]) };
+        const __m128 shear4[3] = { _mm_set1_ps(ray.shear[0]), _mm_set1_ps(ray.shear[1]), _mm_set1_ps(ray.shear[2]) };
+        const __m128 o4_permuted[3] = { o4[ray.k[0]], o4[ray.k[1]], o4[ray.k[2]] };
+        const TrianglePacket& packet = packets[i];
+        __m128 lane_u, lane_v, lane_t;
+        int mask = m_watertight
+            ? intersectPacket4Watertight(packet.v0[0], packet.edge1[0], packet.edge2[0], ray.k, o4_permuted, shear4,
+                                         _mm_set1_ps(ray.mint), _mm_set1_ps(maxt), lane_u, lane_v, lane_t)
+            : intersectPacket4(packet.v0[0], packet.edge1[0], packet.edge2[0], o4, d4,
+                               _mm_set1_ps(ray.mint), _mm_set1_ps(maxt), lane_u, lane_v, lane_t);
+        if (mask) {
+            alignas(16) float us[4], vs[4], ts[4];
+            _mm_store_ps(us, lane_u);
+            _mm_store_ps(vs, lane_v);
+            _mm_store_ps(ts, lane_t);
+            int lane = closestLane(mask, 4, us, vs, ts, maxt, u, v, t);
+            if (lane >= 0)
+                hit = (int) (i * SIMD_PACKET_SIZE) + lane;
+        }
+    }
+    return hit;
+}
+
+#else
+
+/* Without SSE, detectSIMDLevel() always selects the scalar code path */
+uint32_t Accel::intersectChildrenSSE(const LinearNode*, uint32_t, const SIMDRay&, float, float*) { return 0; }
+uint32_t Accel::intersectChildrenAVX2(const LinearNode*, uint32_t, const SIMDRay&, float, float*) { return 0; }
+int Accel::intersectLeafSSE(const LinearNode&, const SIMDRay&, float, float&, float&, float&) const { return -1; }
+int Accel::intersectLeafAVX2(const LinearNode&, const SIMDRay&, float, float&, float&, float&) const { return -1; }
+uint32_t Accel::intersectNodePacketSSE(const LinearNode&, const RayPacket&, uint32_t) { return 0; }
+uint32_t Accel::intersectNodePacketAVX2(const LinearNode&, const RayPacket&, uint32_t) { return 0; }
+
+#endif
+
+NORI_NAMESPACE_END
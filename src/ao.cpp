@@ -11,9 +11,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
+        return LiPrimary(scene, sampler, ray, scene->rayIntersect(ray, its) ? &its : nullptr);
+    }
 
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *hit) const override {
+        if (!hit)
             return {0.f};
+        const Intersection &its = *hit;
 
         auto sampled_dir = Warp::squareToCosineHemisphere(sampler->next2D());
         auto sampled_dir_world = its.shFrame.toWorld(sampled_dir);
@@ -23,6 +27,8 @@ public:
         return 1.f;
     }
 
+    bool usesRayPackets() const override { return true; }
+
     std::string toString() const {
         return "AoIntegrator[]";
     }
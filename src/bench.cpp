@@ -0,0 +1,303 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     nori-bench: ray tracing throughput of the acceleration data structure
+
+     Loads a scene and traces three sets of rays through Accel:
+
+       - primary:  jittered camera rays through all pixels
+       - random:   uniformly distributed origins inside the scene bounds
+                   and directions on the sphere (incoherent)
+       - bounce:   cosine-distributed rays leaving the primary hits, like
+                   the first bounce of a path tracer
+
+     Every set is traced with rayIntersect() and occluded(), the best of
+     several runs is reported in million rays per second. A final pass
+     with the traversal statistics enabled counts the visited nodes and
+     the ray-box and ray-triangle tests per ray.
+ * ======================================================================= */
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/accel.h>
+#include <nori/warp.h>
+#include <nori/frame.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_scheduler_init.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <chrono>
+#include <fstream>
+
+using namespace nori;
+
+/// Throughput and statistics of one set of rays
+struct RaySetResult {
+    std::string name;
+    size_t rayCount = 0;
+    uint64_t closestHits = 0, occludedHits = 0;
+    double closestMrays = 0, occludedMrays = 0;
+    Accel::TraversalStatistics closestStats, occludedStats;
+};
+
+static std::vector<Ray3f> generatePrimaryRays(const Scene *scene, size_t count, pcg32 &rng) {
+    const Camera *camera = scene->getCamera();
+    Vector2i size = camera->getOutputSize();
+    size_t pixelCount = (size_t) size.x() * size.y();
+
+    std::vector<Ray3f> rays(count);
+    for (size_t i = 0; i < count; ++i) {
+        size_t pixel = i % pixelCount;
+        Point2f pixelSample((float) (pixel % size.x()) + rng.nextFloat(), (float) (pixel / size.x()) + rng.nextFloat());
+        camera->sampleRay(rays[i], pixelSample, Point2f(rng.nextFloat(), rng.nextFloat()));
+    }
+    return rays;
+}
+
+static std::vector<Ray3f> generateRandomRays(const Scene *scene, size_t count, pcg32 &rng) {
+    const BoundingBox3f &bbox = scene->getBoundingBox();
+    std::vector<Ray3f> rays(count);
+    for (size_t i = 0; i < count; ++i) {
+        Point3f o = bbox.min + bbox.getExtents().cwiseProduct(Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()));
+        rays[i] = Ray3f(o, Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat())));
+    }
+    return rays;
+}
+
+/// Rays leaving the hits of the primary rays, cosine-distributed around the side of the surface that was hit
+static std::vector<Ray3f> generateBounceRays(const Scene *scene, const std::vector<Ray3f> &primaryRays, pcg32 &rng) {
+    std::vector<Ray3f> rays;
+    rays.reserve(primaryRays.size());
+    for (const Ray3f &primary : primaryRays) {
+        Intersection its;
+        if (!scene->rayIntersect(primary, its))
+            continue;
+        Vector3f n = its.geoFrame.n;
+        if (n.dot(primary.d) > 0)
+            n = -n;
+        Vector3f d = Frame(n).toWorld(Warp::squareToCosineHemisphere(Point2f(rng.nextFloat(), rng.nextFloat())));
+        rays.push_back(Ray3f(its.p, d));
+    }
+    return rays;
+}
+
+/// Trace all rays in parallel, returns the number of hits and the duration in seconds
+template <typename Function> static uint64_t traceRays(const std::vector<Ray3f> &rays, const Function &function,
+        double &seconds) {
+    auto start = std::chrono::high_resolution_clock::now();
+    uint64_t hits = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, rays.size(), 1024), (uint64_t) 0,
+        [&](const tbb::blocked_range<size_t> &range, uint64_t hits) {
+            for (size_t i = range.begin(); i < range.end(); ++i)
+                hits += function(rays[i]) ? 1 : 0;
+            return hits;
+        }, std::plus<uint64_t>());
+    seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    return hits;
+}
+
+static RaySetResult benchmark(Scene *scene, const std::string &name, const std::vector<Ray3f> &rays, int runs) {
+    RaySetResult result;
+    result.name = name;
+    result.rayCount = rays.size();
+    if (rays.empty())
+        return result;
+
+    auto closest = [&](const Ray3f &ray) { Intersection its; return scene->rayIntersect(ray, its); };
+    auto occluded = [&](const Ray3f &ray) { return scene->rayIntersect(ray); };
+
+    for (int run = 0; run < runs; ++run) {
+        double seconds;
+        result.closestHits = traceRays(rays, closest, seconds);
+        result.closestMrays = std::max(result.closestMrays, rays.size() / seconds * 1e-6);
+        result.occludedHits = traceRays(rays, occluded, seconds);
+        result.occludedMrays = std::max(result.occludedMrays, rays.size() / seconds * 1e-6);
+    }
+
+    /* Count the work in a separate pass, the counters are not free */
+    Accel *accel = scene->getAccel();
+    accel->setCollectStatistics(true);
+    double seconds;
+    accel->resetStatistics();
+    traceRays(rays, closest, seconds);
+    result.closestStats = accel->getStatistics();
+    accel->resetStatistics();
+    traceRays(rays, occluded, seconds);
+    result.occludedStats = accel->getStatistics();
+    accel->setCollectStatistics(false);
+    return result;
+}
+
+static void printResult(const RaySetResult &result) {
+    auto perRay = [&](uint64_t value) { return result.rayCount > 0 ? (double) value / result.rayCount : 0.0; };
+    cout << tfm::format("%-8s %9zu rays | closest: %8.2f Mrays/s, %5.1f%% hits, %6.1f nodes, %6.1f boxes, %6.1f triangles"
+                        " | occluded: %8.2f Mrays/s, %6.1f nodes, %6.1f triangles",
+                        result.name, result.rayCount, result.closestMrays,
+                        result.rayCount > 0 ? 100.0 * result.closestHits / result.rayCount : 0.0,
+                        perRay(result.closestStats.nodes_visited), perRay(result.closestStats.boxes_tested),
+                        perRay(result.closestStats.triangles_tested), result.occludedMrays,
+                        perRay(result.occludedStats.nodes_visited), perRay(result.occludedStats.triangles_tested)) << endl;
+}
+
+/// Escape quotes, backslashes and control characters of a JSON string
+static std::string jsonEscape(const std::string &value) {
+    std::string result;
+    for (char c : value) {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((unsigned char) c < 0x20)
+            result += tfm::format("\\u%04x", (int) c);
+        else
+            result += c;
+    }
+    return result;
+}
+
+static std::string jsonStatistics(const Accel::TraversalStatistics &stats, size_t rayCount) {
+    double scale = rayCount > 0 ? 1.0 / rayCount : 0.0;
+    return tfm::format("{ \"nodes_per_ray\": %.3f, \"boxes_per_ray\": %.3f, \"triangles_per_ray\": %.3f }",
+                       stats.nodes_visited * scale, stats.boxes_tested * scale, stats.triangles_tested * scale);
+}
+
+static bool writeJSON(const std::string &filename, const std::string &sceneName, const Accel *accel, int threadCount,
+        const std::vector<RaySetResult> &results) {
+    std::ofstream out(filename);
+    if (!out)
+        return false;
+
+    out << "{" << endl;
+    out << tfm::format("  \"scene\": \"%s\",", jsonEscape(sceneName)) << endl;
+    out << tfm::format("  \"threads\": %d,", threadCount) << endl;
+    out << "  \"accel\": {" << endl;
+    out << tfm::format("    \"type\": \"%s\",", accel->getTypeName()) << endl;
+    out << tfm::format("    \"build_ms\": %.1f,", accel->getBuildTime()) << endl;
+    out << tfm::format("    \"nodes\": %u,", accel->getNodeCount()) << endl;
+    out << tfm::format("    \"sah_cost\": %.4f,", accel->getSAHCost()) << endl;
+    out << tfm::format("    \"memory_bytes\": %zu", accel->getMemoryUsage()) << endl;
+    out << "  }," << endl;
+    out << "  \"rays\": {" << endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const RaySetResult &result = results[i];
+        out << tfm::format("    \"%s\": {", result.name) << endl;
+        out << tfm::format("      \"count\": %zu,", result.rayCount) << endl;
+        out << tfm::format("      \"closest\": { \"mrays_per_s\": %.3f, \"hits\": %llu, \"stats\": %s },",
+                           result.closestMrays, (unsigned long long) result.closestHits,
+                           jsonStatistics(result.closestStats, result.rayCount)) << endl;
+        out << tfm::format("      \"occluded\": { \"mrays_per_s\": %.3f, \"hits\": %llu, \"stats\": %s }",
+                           result.occludedMrays, (unsigned long long) result.occludedHits,
+                           jsonStatistics(result.occludedStats, result.rayCount)) << endl;
+        out << "    }" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  }" << endl;
+    out << "}" << endl;
+    return (bool) out;
+}
+
+static int parsePositive(int argc, char **argv, int &i) {
+    std::string token(argv[i]);
+    int value = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+    if (value <= 0) {
+        cerr << "\"" << token << "\" argument expects a positive integer following it." << endl;
+        exit(-1);
+    }
+    i++;
+    return value;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--threads N] [--rays N] [--runs N] [--json results.json]" << endl;
+        return -1;
+    }
+
+    std::string sceneName, jsonName;
+    int threadCount = tbb::task_scheduler_init::automatic;
+    size_t rayCount = 1000000;
+    int runs = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string token(argv[i]);
+        if (token == "-t" || token == "--threads") {
+            threadCount = parsePositive(argc, argv, i);
+        } else if (token == "--rays") {
+            rayCount = (size_t) parsePositive(argc, argv, i);
+        } else if (token == "--runs") {
+            runs = parsePositive(argc, argv, i);
+        } else if (token == "--json") {
+            if (i + 1 >= argc) {
+                cerr << "\"--json\" argument expects a filename following it." << endl;
+                return -1;
+            }
+            jsonName = argv[++i];
+        } else {
+            filesystem::path path(token);
+            if (path.extension() != "xml") {
+                cerr << "Fatal error: unknown file \"" << token << "\", expected an extension of type .xml" << endl;
+                return -1;
+            }
+            sceneName = token;
+            getFileResolver()->prepend(path.parent_path());
+        }
+    }
+
+    if (sceneName.empty()) {
+        cerr << "Fatal error: no scene file given" << endl;
+        return -1;
+    }
+    if (threadCount == tbb::task_scheduler_init::automatic)
+        threadCount = tbb::task_scheduler_init::default_num_threads();
+
+    try {
+        tbb::task_scheduler_init init(threadCount);
+
+        std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+        if (root->getClassType() != NoriObject::EScene)
+            throw NoriException("\"%s\" does not describe a scene!", sceneName);
+        Scene *scene = static_cast<Scene *>(root.get());
+
+        cout << endl << "Generating rays .. ";
+        cout.flush();
+        pcg32 rng;
+        std::vector<Ray3f> primaryRays = generatePrimaryRays(scene, rayCount, rng);
+        std::vector<Ray3f> randomRays = generateRandomRays(scene, rayCount, rng);
+        std::vector<Ray3f> bounceRays = generateBounceRays(scene, primaryRays, rng);
+        cout << "done." << endl;
+
+        std::vector<RaySetResult> results;
+        results.push_back(benchmark(scene, "primary", primaryRays, runs));
+        results.push_back(benchmark(scene, "random", randomRays, runs));
+        results.push_back(benchmark(scene, "bounce", bounceRays, runs));
+
+        const Accel *accel = scene->getAccel();
+        cout << tfm::format("%s: build %.1fms, %u nodes, SAH cost %.2f, %s, %d threads",
+                            accel->getTypeName(), accel->getBuildTime(), accel->getNodeCount(), accel->getSAHCost(),
+                            memString(accel->getMemoryUsage()), threadCount) << endl;
+        for (const RaySetResult &result : results)
+            printResult(result);
+
+        if (!jsonName.empty() && !writeJSON(jsonName, sceneName, accel, threadCount, results))
+            throw NoriException("Could not write \"%s\"", jsonName);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
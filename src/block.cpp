@@ -21,6 +21,7 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
@@ -58,10 +59,20 @@ Bitmap *ImageBlock::toBitmap() const {
     Bitmap *result = new Bitmap(m_size);
     for (int y=0; y<m_size.y(); ++y)
         for (int x=0; x<m_size.x(); ++x)
-            result->coeffRef(y, x) = coeff(y + m_borderSize, x + m_borderSize).divideByFilterWeight();
+            result->coeffRef(y, x) = getPixel(y + m_borderSize, x + m_borderSize).divideByFilterWeight();
     return result;
 }
 
+Color4f ImageBlock::getPixel(Eigen::Index y, Eigen::Index x) const {
+    Color4f value = coeff(y, x);
+    if (m_shared) {
+        const std::atomic<float> *shared = &m_shared[4 * (y * cols() + x)];
+        for (int i=0; i<4; ++i)
+            value[i] += shared[i].load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
 void ImageBlock::fromBitmap(const Bitmap &bitmap) {
     if (bitmap.cols() != cols() || bitmap.rows() != rows())
         throw NoriException("Invalid bitmap dimensions!");
@@ -71,6 +82,43 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
             coeffRef(y, x) << bitmap.coeff(y, x), 1;
 }
 
+void ImageBlock::clear() {
+    setConstant(Color4f());
+    m_moments.setZero();
+    if (m_shared)
+        for (Eigen::Index i=0; i<4 * size(); ++i)
+            m_shared[i].store(0.f, std::memory_order_relaxed);
+    if (m_preview.size() > 0)
+        m_preview.setConstant(Color4f());
+}
+
+void ImageBlock::enablePreview() {
+    m_preview.resize(rows(), cols());
+    for (Eigen::Index y=0; y<rows(); ++y)
+        for (Eigen::Index x=0; x<cols(); ++x)
+            m_preview(y, x) = getPixel(y, x);
+}
+
+void ImageBlock::trackVariance() {
+    m_moments.resize((cols() - 2 * m_borderSize) * (rows() - 2 * m_borderSize), 3);
+    m_moments.setZero();
+}
+
+float ImageBlock::getRelativeError(const Point2i &pixel, int radius) const {
+    double count = m_moments(momentIndex(pixel), 0);
+    if (count < 2)
+        return std::numeric_limits<float>::infinity();
+
+    Eigen::Array3d moments = Eigen::Array3d::Zero();
+    for (int y=std::max(pixel.y() - radius, 0); y<=std::min(pixel.y() + radius, m_size.y() - 1); ++y)
+        for (int x=std::max(pixel.x() - radius, 0); x<=std::min(pixel.x() + radius, m_size.x() - 1); ++x)
+            moments += m_moments.row(momentIndex(Point2i(x, y))).transpose();
+
+    double mean = moments(1) / moments(0);
+    double variance = std::max(0.0, (moments(2) - moments(1) * mean) / (moments(0) - 1));
+    return (float) (std::sqrt(variance / count) / std::max(mean, (double) NORI_MIN_ERROR_LUMINANCE));
+}
+
 void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
     if (!value.isValid()) {
         /* If this happens, go fix your code instead of removing this warning ;) */
@@ -78,6 +126,14 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
         return;
     }
 
+    if (tracksVariance()) {
+        Point2i pixel((int) std::floor(_pos.x()) - m_offset.x(), (int) std::floor(_pos.y()) - m_offset.y());
+        if ((pixel.array() >= 0).all() && (pixel.array() < m_size.array()).all()) {
+            double luminance = value.getLuminance();
+            m_moments.row(momentIndex(pixel)) += Eigen::Array3d(1.0, luminance, luminance * luminance).transpose();
+        }
+    }
+
     /* Convert to pixel coordinates within the image block */
     Point2f pos(
         _pos.x() - 0.5f - (m_offset.x() - m_borderSize),
@@ -102,15 +158,69 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
             coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
 }
     
+/// Add to a value that other threads may update at the same time
+static inline void atomicAdd(std::atomic<float> &target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        ;
+}
+
 void ImageBlock::put(ImageBlock &b) {
     Vector2i offset = b.getOffset() - m_offset +
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    /* Blocks never overlap, only their borders reach into the neighbouring
+       blocks. Pixels further than the border of the block and that of its
+       neighbours from the edge therefore belong to this block alone and are
+       added directly. The remaining band is shared with the neighbours and
+       accumulated in a separate buffer of atomics. */
+    if (tracksVariance() && b.tracksVariance()) {
+        Point2i pixelOffset = b.getOffset() - m_offset;
+        for (int y=0; y<b.getSize().y(); ++y)
+            for (int x=0; x<b.getSize().x(); ++x)
+                m_moments.row(momentIndex(pixelOffset + Point2i(x, y))) += b.m_moments.row(b.momentIndex(Point2i(x, y)));
+    }
+
+    int band = 2 * b.getBorderSize();
+    Vector2i interior = size - Vector2i::Constant(2 * band);
+
+    std::call_once(m_sharedAllocated, [&] {
+        m_shared.reset(new std::atomic<float>[4 * rows() * cols()]);
+        for (Eigen::Index i=0; i<4 * rows() * cols(); ++i)
+            m_shared[i].store(0.f, std::memory_order_relaxed);
+    });
+
+    auto putShared = [&](int y0, int y1, int x0, int x1) {
+        for (int y=y0; y<y1; ++y) {
+            for (int x=x0; x<x1; ++x) {
+                std::atomic<float> *target = &m_shared[4 * ((offset.y() + y) * cols() + offset.x() + x)];
+                const Color4f &value = b.coeff(y, x);
+                for (int i=0; i<4; ++i)
+                    atomicAdd(target[i], value[i]);
+            }
+        }
+    };
+
+    if ((interior.array() <= 0).any()) {
+        putShared(0, size.y(), 0, size.x());
+    } else {
+        block(offset.y() + band, offset.x() + band, interior.y(), interior.x())
+            += b.block(band, band, interior.y(), interior.x());
+        putShared(0, band, 0, size.x());
+        putShared(size.y() - band, size.y(), 0, size.x());
+        putShared(band, size.y() - band, 0, band);
+        putShared(band, size.y() - band, size.x() - band, size.x());
+    }
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+    /* No other thread writes the pixels of this block directly, so they can
+       be copied. The last copy of a pixel happens after all additions to it. */
+    if (m_preview.size() > 0) {
+        tbb::mutex::scoped_lock lock(m_mutex);
+        for (int y=0; y<size.y(); ++y)
+            for (int x=0; x<size.x(); ++x)
+                m_preview(offset.y() + y, offset.x() + x) = getPixel(offset.y() + y, offset.x() + x);
+    }
 }
 
 std::string ImageBlock::toString() const {
@@ -118,49 +228,114 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
+/// Position of the point with the given index on a Hilbert curve covering a grid of n x n cells (n a power of two)
+static Point2i hilbertPoint(int n, int index) {
+    Point2i p(0, 0);
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (index / 2);
+        int ry = 1 & (index ^ rx);
+        if (ry == 0) {
+            if (rx == 1)
+                p = Point2i(s - 1 - p.x(), s - 1 - p.y());
+            std::swap(p.x(), p.y());
+        }
+        p += Point2i(s * rx, s * ry);
+        index /= 4;
+    }
+    return p;
+}
+
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, EOrder order)
+        : m_size(size), m_blockSize(blockSize), m_next(0) {
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+    int blockCount = m_numBlocks.x() * m_numBlocks.y();
+    m_blocks.reserve(blockCount);
+
+    auto inside = [&](const Point2i &block) {
+        return (block.array() >= 0).all() && (block.array() < m_numBlocks.array()).all();
+    };
+
+    switch (order) {
+        case ESpiral: {
+            Point2i block = Point2i(m_numBlocks / 2);
+            int direction = ERight, numSteps = 1, stepsLeft = 1;
+            while ((int) m_blocks.size() < blockCount) {
+                if (inside(block))
+                    m_blocks.push_back(block);
+
+                switch (direction) {
+                    case ERight: ++block.x(); break;
+                    case EDown:  ++block.y(); break;
+                    case ELeft:  --block.x(); break;
+                    case EUp:    --block.y(); break;
+                }
+
+                if (--stepsLeft == 0) {
+                    direction = (direction + 1) % 4;
+                    if (direction == ELeft || direction == ERight)
+                        ++numSteps;
+                    stepsLeft = numSteps;
+                }
+            }
+            break;
+        }
+
+        case EHilbert: {
+            int n = 1;
+            while (n < m_numBlocks.maxCoeff())
+                n *= 2;
+            for (int i = 0; i < n * n; ++i) {
+                Point2i block = hilbertPoint(n, i);
+                if (inside(block))
+                    m_blocks.push_back(block);
+            }
+            break;
+        }
+
+        case EScanline:
+            for (int y = 0; y < m_numBlocks.y(); ++y)
+                for (int x = 0; x < m_numBlocks.x(); ++x)
+                    m_blocks.push_back(Point2i(x, y));
+            break;
+
+        default:
+            throw NoriException("BlockGenerator: unknown block order!");
+    }
 }
 
 bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
-
-    if (m_blocksLeft == 0)
+    /* The order is fixed, so the index is all that threads need to agree on */
+    int index = m_next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= (int) m_blocks.size())
         return false;
 
-    Point2i pos = m_block * m_blockSize;
+    Point2i pos = m_blocks[index] * m_blockSize;
     block.setOffset(pos);
     block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+    return true;
+}
 
-    if (--m_blocksLeft == 0)
-        return true;
-
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
-        }
+void BlockGenerator::sortByCost(const std::vector<float> &cost) {
+    if (cost.size() != m_blocks.size())
+        throw NoriException("BlockGenerator: expected the cost of %i blocks, got %i!", m_blocks.size(), cost.size());
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
-        }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+    auto blockCost = [&](const Point2i &block) { return cost[block.y() * m_numBlocks.x() + block.x()]; };
+    std::stable_sort(m_blocks.begin(), m_blocks.end(), [&](const Point2i &a, const Point2i &b) {
+        return blockCost(a) > blockCost(b);
+    });
+    reset();
+}
 
-    return true;
+BlockGenerator::EOrder BlockGenerator::parseOrder(const std::string &name) {
+    if (name == "spiral")
+        return ESpiral;
+    else if (name == "hilbert")
+        return EHilbert;
+    else if (name == "scanline")
+        return EScanline;
+    throw NoriException("Unknown block order \"%s\", expected spiral, hilbert or scanline!", name);
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,63 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <memory>
+
+using namespace nori;
+
+/**
+ * Converts Wavefront OBJ files into the binary mesh format, which scenes
+ * load with <tt>&lt;mesh type="nmesh"&gt;</tt> in a fraction of the time.
+ */
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        cerr << "Syntax: " << argv[0] << " <mesh.obj> [mesh.nmesh]" << endl;
+        return -1;
+    }
+
+    std::string inputName(argv[1]), outputName;
+    filesystem::path path(inputName);
+    if (path.extension() != "obj") {
+        cerr << "Fatal error: unknown file \"" << inputName << "\", expected an extension of type .obj" << endl;
+        return -1;
+    }
+    if (argc == 3)
+        outputName = argv[2];
+    else
+        outputName = inputName.substr(0, inputName.size() - 3) + "nmesh";
+
+    try {
+        PropertyList props;
+        props.setString("filename", inputName);
+        std::unique_ptr<NoriObject> mesh(NoriObjectFactory::createInstance("obj", props));
+
+        cout << "Writing \"" << outputName << "\" .. ";
+        cout.flush();
+        Timer timer;
+        saveBinaryMesh(static_cast<const Mesh *>(mesh.get()), outputName);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -92,16 +92,18 @@ NoriScreen::~NoriScreen() {
 }
 
 void NoriScreen::drawContents() {
-    /* Reload the partially rendered image onto the GPU */
+    /* Reload the partially rendered image onto the GPU. The render
+       threads merge their blocks into a copy of it meanwhile */
     m_block.lock();
+    const auto &preview = m_block.getPreview();
     int borderSize = m_block.getBorderSize();
     const Vector2i &size = m_block.getSize();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_texture);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) m_block.cols());
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint) preview.cols());
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, size.x(), size.y(),
-            0, GL_RGBA, GL_FLOAT, (uint8_t *) m_block.data() +
-            (borderSize * m_block.cols() + borderSize) * sizeof(Color4f));
+            0, GL_RGBA, GL_FLOAT, (uint8_t *) preview.data() +
+            (borderSize * preview.cols() + borderSize) * sizeof(Color4f));
     glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     m_block.unlock();
 
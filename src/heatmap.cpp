@@ -0,0 +1,85 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Visualizes the work of the acceleration data structure
+ *
+ * Every pixel stores the average number of nodes visited, boxes tested
+ * or triangles tested by its camera rays (see Accel::TraversalStatistics).
+ * By default the counts are written to all channels as they are, so the
+ * EXR output holds the per-pixel cost. With a positive \c scale, they are
+ * mapped to a blue-green-red ramp instead, where \c scale is red.
+ */
+class HeatmapIntegrator : public Integrator {
+public:
+    enum EMetric {
+        ENodes = 0,
+        EBoxes,
+        ETriangles
+    };
+
+    HeatmapIntegrator(const PropertyList &props) {
+        std::string metric = props.getString("metric", "nodes");
+        if (metric == "nodes")
+            m_metric = ENodes;
+        else if (metric == "boxes")
+            m_metric = EBoxes;
+        else if (metric == "triangles")
+            m_metric = ETriangles;
+        else
+            throw NoriException("HeatmapIntegrator: unknown metric \"%s\"!", metric);
+
+        m_scale = props.getFloat("scale", 0.f);
+        if (m_scale < 0.f)
+            throw NoriException("HeatmapIntegrator: the scale must be positive!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        /* Count the work of this ray only, packet queries are not counted */
+        Accel::TraversalStatistics stats;
+        Accel::HitRecord hit;
+        scene->getAccel()->rayIntersect(ray, hit, &stats);
+
+        float cost = (float) (m_metric == ENodes ? stats.nodes_visited
+            : (m_metric == EBoxes ? stats.boxes_tested : stats.triangles_tested));
+        if (m_scale == 0.f)
+            return Color3f(cost);
+
+        /* Blue (no work) over green to red (scale and above) */
+        float x = std::min(cost / m_scale, 1.f) * 2.f;
+        return x < 1.f ? Color3f(0.f, x, 1.f - x) : Color3f(x - 1.f, 2.f - x, 0.f);
+    }
+
+    std::string toString() const {
+        return tfm::format("HeatmapIntegrator[ metric: %s, scale: %f ]",
+                           m_metric == ENodes ? "nodes" : (m_metric == EBoxes ? "boxes" : "triangles"), m_scale);
+    }
+
+protected:
+    EMetric m_metric;
+    float m_scale;
+};
+
+NORI_REGISTER_CLASS(HeatmapIntegrator, "heatmap");
+NORI_NAMESPACE_END
@@ -45,11 +45,13 @@ public:
         return std::move(cloned);
     }
 
-    void prepare(const ImageBlock &block) {
+    void prepare(const ImageBlock &block, uint32_t pass) {
         m_random.seed(
             block.getOffset().x(),
             block.getOffset().y()
         );
+        /* Successive passes continue far enough down the stream to never overlap */
+        m_random.advance((int64_t) pass << 40);
     }
 
     void generate() { /* No-op for this sampler */ }
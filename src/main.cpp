@@ -22,11 +22,11 @@
 #include <nori/block.h>
 #include <nori/timer.h>
 #include <nori/bitmap.h>
-#include <nori/sampler.h>
 #include <nori/integrator.h>
+#include <nori/render.h>
+#if !defined(NORI_HEADLESS)
 #include <nori/gui.h>
-#include <tbb/parallel_for.h>
-#include <tbb/blocked_range.h>
+#endif
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
 #include <thread>
@@ -34,106 +34,58 @@
 using namespace nori;
 
 static int threadCount = -1;
-
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
-    const Camera *camera = scene->getCamera();
-    const Integrator *integrator = scene->getIntegrator();
-
-    Point2i offset = block.getOffset();
-    Vector2i size  = block.getSize();
-
-    /* Clear the block contents */
-    block.clear();
-
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-                Point2f apertureSample = sampler->next2D();
-
-                /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
-
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
-
-                /* Store in the image block */
-                block.put(pixelSample, value);
-            }
-        }
-    }
-}
+static int buildThreadCount = -1;
+#if defined(NORI_HEADLESS)
+static bool headless = true;                /* Built without the user interface */
+#else
+static bool headless = false;
+#endif
 
 static void render(Scene *scene, const std::string &filename) {
     const Camera *camera = scene->getCamera();
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
-
     /* Allocate memory for the entire output image and clear it */
     ImageBlock result(outputSize, camera->getReconstructionFilter());
     result.clear();
 
-    /* Create a window that visualizes the partially rendered result */
-    nanogui::init();
-    NoriScreen *screen = new NoriScreen(result);
-
-    /* Do the following in parallel and asynchronously */
-    std::thread render_thread([&] {
+    auto renderTask = [&] {
         tbb::task_scheduler_init init(threadCount);
 
-        cout << "Rendering .. ";
+        cout << (headless || getRenderSettings()->progressive ? "Rendering ..\n" : "Rendering .. ");
         cout.flush();
         Timer timer;
 
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
-
-        auto map = [&](const tbb::blocked_range<int> &range) {
-            /* Allocate memory for a small image block to be rendered
-               by the current thread */
-            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                camera->getReconstructionFilter());
-
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
-
-            for (int i=range.begin(); i<range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
+        renderImage(scene, result);
 
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
-
-                /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
-
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
-            }
-        };
-
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    };
 
-        /// (equivalent to the following single-threaded call)
-        // map(range);
+    if (headless) {
+        /* No window and no OpenGL context, render on this thread */
+        renderTask();
+    }
+#if !defined(NORI_HEADLESS)
+    else {
+        /* Create a window that visualizes the partially rendered result */
+        result.enablePreview();
+        nanogui::init();
+        NoriScreen *screen = new NoriScreen(result);
 
-        cout << "done. (took " << timer.elapsedString() << ")" << endl;
-    });
+        /* Do the following in parallel and asynchronously */
+        std::thread render_thread(renderTask);
 
-    /* Enter the application main loop */
-    nanogui::mainloop();
+        /* Enter the application main loop */
+        nanogui::mainloop();
 
-    /* Shut down the user interface */
-    render_thread.join();
+        /* Shut down the user interface */
+        render_thread.join();
 
-    delete screen;
-    nanogui::shutdown();
+        delete screen;
+        nanogui::shutdown();
+    }
+#endif
 
     /* Now turn the rendered image block into
        a properly normalized bitmap */
@@ -160,6 +112,9 @@ int main(int argc, char **argv) {
     }
 
     std::string sceneName = "";
+    RenderSettings *settings = getRenderSettings();
+    std::vector<PropertyOverride> overrides;
+    std::vector<std::string> files;
 
     for (int i = 1; i < argc; ++i) {
         std::string token(argv[i]);
@@ -178,19 +133,121 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        filesystem::path path(argv[i]);
+        if (token == "--build-threads") {
+            if (i+1 >= argc) {
+                cerr << "\"--build-threads\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            buildThreadCount = atoi(argv[i+1]);
+            i++;
+            if (buildThreadCount <= 0) {
+                cerr << "\"--build-threads\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (token == "--block-order") {
+            if (i+1 >= argc) {
+                cerr << "\"--block-order\" argument expects spiral, hilbert or scanline following it." << endl;
+                return -1;
+            }
+            try {
+                settings->blockOrder = BlockGenerator::parseOrder(argv[i+1]);
+            } catch (const std::exception &e) {
+                cerr << "Fatal error: " << e.what() << endl;
+                return -1;
+            }
+            i++;
+            continue;
+        }
+
+        if (token == "--property") {
+            if (i+1 >= argc) {
+                cerr << "\"--property\" argument expects tag.name=value following it." << endl;
+                return -1;
+            }
+            try {
+                overrides.push_back(PropertyOverride(argv[i+1]));
+            } catch (const std::exception &e) {
+                cerr << "Fatal error: " << e.what() << endl;
+                return -1;
+            }
+            i++;
+            continue;
+        }
+
+        if (token == "--spp" || token == "--pass-spp") {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            if (token == "--spp") {
+                settings->targetSampleCount = (uint32_t) atoi(argv[i+1]);
+            } else {
+                settings->passSampleCount = (uint32_t) atoi(argv[i+1]);
+                settings->progressive = true;
+            }
+            i++;
+            continue;
+        }
+
+        if (token == "--time-budget" || token == "--noise-threshold") {
+            if (i+1 >= argc || atof(argv[i+1]) <= 0) {
+                cerr << "\"" << token << "\" argument expects a positive number following it." << endl;
+                return -1;
+            }
+            if (token == "--time-budget")
+                settings->timeBudget = atof(argv[i+1]);
+            else
+                settings->noiseThreshold = (float) atof(argv[i+1]);
+            settings->progressive = true;
+            i++;
+            continue;
+        }
+
+        if (token == "--progressive") {
+            settings->progressive = true;
+            continue;
+        }
+
+        if (token == "--adaptive") {
+            settings->progressive = settings->adaptive = true;
+            continue;
+        }
+
+        if (token == "--headless") {
+            headless = true;
+            continue;
+        }
+
+        /* Files are handled once all options are known */
+        files.push_back(argv[i]);
+    }
+
+    /* Without a window, print the progress of the render instead */
+    settings->reportProgress = headless;
+
+    for (const std::string &file: files) {
+        filesystem::path path(file);
 
         try {
             if (path.extension() == "xml") {
-                sceneName = argv[i];
+                sceneName = file;
 
                 /* Add the parent directory of the scene file to the
                    file resolver. That way, the XML file can reference
                    resources (OBJ files, textures) using relative paths */
                 getFileResolver()->prepend(path.parent_path());
-            } else if (path.extension() == "exr") {
+            } else if (path.extension() == "exr" && headless) {
+                cerr << "Fatal error: the image viewer is not available in headless mode" << endl;
+                return -1;
+            }
+#if !defined(NORI_HEADLESS)
+            else if (path.extension() == "exr") {
                 /* Alternatively, provide a basic OpenEXR image viewer */
-                Bitmap bitmap(argv[i]);
+                Bitmap bitmap(file);
                 ImageBlock block(Vector2i((int) bitmap.cols(), (int) bitmap.rows()), nullptr);
                 block.fromBitmap(bitmap);
                 nanogui::init();
@@ -198,8 +255,10 @@ int main(int argc, char **argv) {
                 nanogui::mainloop();
                 delete screen;
                 nanogui::shutdown();
-            } else {
-                cerr << "Fatal error: unknown file \"" << argv[i]
+            }
+#endif
+            else {
+                cerr << "Fatal error: unknown file \"" << file
                      << "\", expected an extension of type .xml or .exr" << endl;
             }
         } catch (const std::exception &e) {
@@ -212,8 +271,18 @@ int main(int argc, char **argv) {
         threadCount = tbb::task_scheduler_init::automatic;
     }
 
+    if (buildThreadCount < 0) {
+        buildThreadCount = tbb::task_scheduler_init::automatic;
+    }
+
     if (sceneName != "") {
-            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+            std::unique_ptr<NoriObject> root;
+            {
+                /* Scene loading (which includes building the acceleration
+                   data structure) runs on its own set of worker threads */
+                tbb::task_scheduler_init init(buildThreadCount);
+                root.reset(loadFromXML(sceneName, overrides));
+            }
             /* When the XML root object is a scene, start rendering it .. */
             if (root->getClassType() == NoriObject::EScene)
                 render(static_cast<Scene *>(root.get()), sceneName);
@@ -33,6 +33,9 @@ Mesh::~Mesh() {
 }
 
 void Mesh::activate() {
+    if (m_compact)
+        compact();
+
     if (!m_bsdf) {
         /* If no material was assigned, instantiate a diffuse BRDF */
         m_bsdf = static_cast<BSDF *>(
@@ -49,8 +52,86 @@ void Mesh::activate() {
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &positions, const MatrixXf &normals) {
+    if (positions.rows() != 3 || positions.cols() != m_V.cols())
+        throw NoriException("Mesh \"%s\": expected %d new vertex positions, got %d!", m_name, m_V.cols(), positions.cols());
+    if (normals.size() > 0 && (normals.rows() != 3 || normals.cols() != m_V.cols()))
+        throw NoriException("Mesh \"%s\": expected %d new vertex normals, got %d!", m_name, m_V.cols(), normals.cols());
+
+    m_V = positions;
+    m_N = normals;
+    if (m_compact) {
+        /* Keep the normals in the compact representation */
+        m_compactN.clear();
+        if (m_N.size() > 0)
+            compact();
+    }
+    m_bbox.reset();
+    for (int i = 0; i < m_V.cols(); i++)
+        m_bbox.expandBy(Point3f(m_V.col(i)));
+
+    // the triangle areas have changed
+    if (isEmitter()) {
+        m_dpdf.clear();
+        m_dpdf.reserve(getTriangleCount());
+        for (uint32_t i = 0; i < getTriangleCount(); i++)
+            m_dpdf.append(surfaceArea(i));
+        m_dpdf.normalize();
+    }
+}
+
+void Mesh::compact() {
+    if (m_N.size() > 0) {
+        m_compactN.resize(m_N.cols());
+        for (Eigen::Index i = 0; i < m_N.cols(); ++i)
+            m_compactN[i] = encodeNormal(m_N.col(i));
+        m_N = MatrixXf();
+    }
+
+    if (m_UV.size() > 0) {
+        /* Quantize relative to the range of the texture coordinates, they may exceed [0, 1] */
+        Point2f uv_min = m_UV.rowwise().minCoeff(), uv_max = m_UV.rowwise().maxCoeff();
+        m_uvOffset = uv_min;
+        m_uvScale = (uv_max - uv_min) / 65535.f;
+        m_compactUV.resize(2, m_UV.cols());
+        for (Eigen::Index i = 0; i < m_UV.cols(); ++i) {
+            for (int k = 0; k < 2; ++k) {
+                float value = m_uvScale[k] > 0.f ? (m_UV(k, i) - uv_min[k]) / m_uvScale[k] : 0.f;
+                m_compactUV(k, i) = (uint16_t) std::min(std::max(std::round(value), 0.f), 65535.f);
+            }
+        }
+        m_UV = MatrixXf();
+    }
+
+    if (m_F.size() > 0 && m_V.cols() <= 65536) {
+        m_F16 = m_F.cast<uint16_t>();
+        m_F = MatrixXu();
+    }
+}
+
+uint32_t Mesh::encodeNormal(const Normal3f &n) {
+    float norm = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+    if (norm == 0.f)
+        return 0;
+    float x = n.x() / norm, y = n.y() / norm;
+    if (n.z() < 0.f) {
+        /* Fold the lower hemisphere over the diagonals */
+        float folded_x = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+        y = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+        x = folded_x;
+    }
+    int16_t qx = (int16_t) std::round(std::min(std::max(x, -1.f), 1.f) * 32767.f);
+    int16_t qy = (int16_t) std::round(std::min(std::max(y, -1.f), 1.f) * 32767.f);
+    return (uint32_t) (uint16_t) qx | ((uint32_t) (uint16_t) qy << 16);
+}
+
+size_t Mesh::getMemoryUsage() const {
+    return sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()) + sizeof(uint32_t) * (m_F.size() + m_compactN.size()) +
+           sizeof(uint16_t) * (m_compactUV.size() + m_F16.size());
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0 = getVertexIndex(index, 0), i1 = getVertexIndex(index, 1), i2 = getVertexIndex(index, 2);
 
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
@@ -58,7 +139,7 @@ float Mesh::surfaceArea(uint32_t index) const {
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    uint32_t i0 = getVertexIndex(index, 0), i1 = getVertexIndex(index, 1), i2 = getVertexIndex(index, 2);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
@@ -97,17 +178,17 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result(m_V.col(getVertexIndex(index, 0)));
+    result.expandBy(m_V.col(getVertexIndex(index, 1)));
+    result.expandBy(m_V.col(getVertexIndex(index, 2)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (m_V.col(getVertexIndex(index, 0)) +
+         m_V.col(getVertexIndex(index, 1)) +
+         m_V.col(getVertexIndex(index, 2)));
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -140,12 +221,15 @@ std::string Mesh::toString() const {
         "  name = \"%s\",\n"
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
+        "  memory = %s%s,\n"
         "  bsdf = %s,\n"
         "  emitter = %s\n"
         "]",
         m_name,
         m_V.cols(),
-        m_F.cols(),
+        getTriangleCount(),
+        memString(getMemoryUsage()),
+        m_compact ? " (compact)" : "",
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
@@ -160,16 +244,19 @@ Point3f Mesh::sampleSurfaceUniform(Sampler* sampler, Normal3f &normal, float &pd
     float beta = sample_2d.y() * sqrt(1 - sample_2d.x());
 
     // sample point on triangle using baryzentric coordinates
-    Point3f v_a = m_V.col(m_F(0, triangle_idx));
-    Point3f v_b = m_V.col(m_F(1, triangle_idx));
-    Point3f v_c = m_V.col(m_F(2, triangle_idx));
+    uint32_t idx_a = getVertexIndex(triangle_idx, 0);
+    uint32_t idx_b = getVertexIndex(triangle_idx, 1);
+    uint32_t idx_c = getVertexIndex(triangle_idx, 2);
+    Point3f v_a = m_V.col(idx_a);
+    Point3f v_b = m_V.col(idx_b);
+    Point3f v_c = m_V.col(idx_c);
     Point3f sampled_point = alpha * v_a + beta * v_b + (1 - alpha - beta) * v_c;
 
     // sample normal using baryzentric coordinates
-    if (m_N.size() != 0) {
-        Point3f n_a = m_N.col(m_F(0, triangle_idx));
-        Point3f n_b = m_N.col(m_F(1, triangle_idx));
-        Point3f n_c = m_N.col(m_F(2, triangle_idx));
+    if (hasVertexNormals()) {
+        Normal3f n_a = getVertexNormal(idx_a);
+        Normal3f n_b = getVertexNormal(idx_b);
+        Normal3f n_c = getVertexNormal(idx_c);
         normal = (alpha * n_a + beta * n_b + (1 - alpha - beta) * n_c).normalized();
     } else {
         // calculate the surface normal of the triangle if vertex normals are not present
@@ -0,0 +1,214 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     Binary mesh format (.nmesh), written by nori-convert.
+
+     The file starts with a fixed size header followed by the arrays of
+     the mesh in exactly the layout of Mesh::m_V, m_N, m_UV and m_F
+     (column-major 32 bit floats and indices, little-endian). Every array
+     starts at a multiple of NMESH_ALIGNMENT bytes, so that the loader
+     maps the file into memory and uses the arrays where they are instead
+     of parsing or copying anything.
+ * ======================================================================= */
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+static constexpr char     NMESH_MAGIC[8] = { 'N', 'O', 'R', 'I', 'M', 'S', 'H', '\0' };
+static constexpr uint32_t NMESH_VERSION = 1;   ///< Increase whenever the layout of the file changes
+static constexpr uint64_t NMESH_ALIGNMENT = 64;
+
+/// Arrays stored in the file, in file order
+enum ENMeshSection {
+    ENMeshPositions = 0,
+    ENMeshNormals,
+    ENMeshTexCoords,
+    ENMeshIndices,
+    ENMeshSectionCount
+};
+
+struct NMeshSection {
+    uint64_t offset; ///< Position in the file in bytes
+    uint64_t size;   ///< Size in bytes, zero if the mesh has no such data
+};
+
+struct NMeshHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    float bbox[6];
+    NMeshSection sections[ENMeshSectionCount];
+};
+
+template <typename Matrix> static void writeSection(std::ofstream &out, const Matrix &data, NMeshSection &section) {
+    static const char padding[NMESH_ALIGNMENT] = { };
+    uint64_t offset = (uint64_t) out.tellp();
+    uint64_t aligned = (offset + NMESH_ALIGNMENT - 1) / NMESH_ALIGNMENT * NMESH_ALIGNMENT;
+    out.write(padding, (std::streamsize) (aligned - offset));
+    section.offset = aligned;
+    section.size = data.size() * sizeof(typename Matrix::Scalar);
+    out.write(reinterpret_cast<const char *>(data.data()), (std::streamsize) section.size);
+}
+
+void saveBinaryMesh(const Mesh *mesh, const std::string &filename) {
+    if (mesh->isCompact())
+        throw NoriException("Compact meshes cannot be saved as binary mesh!");
+
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC));
+    header.version = NMESH_VERSION;
+    header.vertex_count = mesh->getVertexCount();
+    header.triangle_count = mesh->getTriangleCount();
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+    for (int i = 0; i < 3; i++) {
+        header.bbox[i] = bbox.min[i];
+        header.bbox[i + 3] = bbox.max[i];
+    }
+
+    // write to a temporary file first, so that a failed conversion never leaves a partial mesh behind
+    std::string temp_file = filename + ".tmp";
+    std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw NoriException("Unable to create \"%s\"!", temp_file);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(NMeshHeader));
+    NMeshSection *sections = header.sections;
+    writeSection(out, mesh->getVertexPositions(), sections[ENMeshPositions]);
+    writeSection(out, mesh->getVertexNormals(), sections[ENMeshNormals]);
+    writeSection(out, mesh->getVertexTexCoords(), sections[ENMeshTexCoords]);
+    writeSection(out, mesh->getIndices(), sections[ENMeshIndices]);
+
+    // the section table is only known now
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(NMeshHeader));
+    out.close();
+    if (!out) {
+        std::remove(temp_file.c_str());
+        throw NoriException("Unable to write \"%s\"!", filename);
+    }
+    // renaming onto an existing file fails on some platforms
+    std::remove(filename.c_str());
+    if (std::rename(temp_file.c_str(), filename.c_str()) != 0)
+        throw NoriException("Unable to write \"%s\"!", filename);
+}
+
+/**
+ * \brief Loader for the binary mesh format written by nori-convert
+ *
+ * The file is mapped into memory and the mesh refers to its arrays
+ * directly. Only a \c toWorld transformation other than the identity
+ * requires a copy of the vertex positions and normals.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        m_compact = propList.getBoolean("compact", false);
+
+        Timer timer;
+
+        m_file.reset(new MemoryMappedFile(filename.str()));
+        uint8_t *data = m_file->data();
+        size_t file_size = m_file->size();
+
+        NMeshHeader header;
+        if (file_size < sizeof(NMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh!", filename);
+        memcpy(&header, data, sizeof(NMeshHeader));
+        if (memcmp(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC)) != 0)
+            throw NoriException("\"%s\" is not a binary mesh!", filename);
+        if (header.version != NMESH_VERSION)
+            throw NoriException("\"%s\" has version %u, expected %u. Please convert it again!",
+                                filename, header.version, NMESH_VERSION);
+        if (header.vertex_count > std::numeric_limits<uint32_t>::max() ||
+                header.triangle_count > std::numeric_limits<uint32_t>::max())
+            throw NoriException("\"%s\" is too large!", filename);
+
+        Eigen::Index vertex_count = (Eigen::Index) header.vertex_count;
+        Eigen::Index triangle_count = (Eigen::Index) header.triangle_count;
+        float *positions = section<float>(header, ENMeshPositions, 3 * header.vertex_count, false, filename.str());
+        float *normals = section<float>(header, ENMeshNormals, 3 * header.vertex_count, true, filename.str());
+        float *texcoords = section<float>(header, ENMeshTexCoords, 2 * header.vertex_count, true, filename.str());
+        uint32_t *indices = section<uint32_t>(header, ENMeshIndices, 3 * header.triangle_count, false, filename.str());
+
+        for (Eigen::Index i = 0; i < 3 * triangle_count; ++i) {
+            if (indices[i] >= header.vertex_count)
+                throw NoriException("\"%s\" is corrupt, a triangle refers to vertex %u!", filename, indices[i]);
+        }
+        m_F.map(indices, 3, triangle_count);
+        if (texcoords)
+            m_UV.map(texcoords, 2, vertex_count);
+
+        if (trafo.getMatrix().isIdentity()) {
+            m_V.map(positions, 3, vertex_count);
+            if (normals)
+                m_N.map(normals, 3, vertex_count);
+            m_bbox.min = Point3f(header.bbox[0], header.bbox[1], header.bbox[2]);
+            m_bbox.max = Point3f(header.bbox[3], header.bbox[4], header.bbox[5]);
+        } else {
+            m_V.resize(3, vertex_count);
+            for (Eigen::Index i = 0; i < vertex_count; ++i) {
+                Point3f p = trafo * Point3f(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]);
+                m_V.col(i) = p;
+                m_bbox.expandBy(p);
+            }
+            if (normals) {
+                m_N.resize(3, vertex_count);
+                for (Eigen::Index i = 0; i < vertex_count; ++i)
+                    m_N.col(i) = (trafo * Normal3f(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2])).normalized();
+            }
+        }
+
+        m_name = filename.str();
+        /* A single write, the parser loads meshes concurrently */
+        cout << tfm::format("Loaded \"%s\" (V=%d, F=%d, took %s and %s mapped)\n", filename, m_V.cols(), m_F.cols(),
+                            timer.elapsedString(), memString(file_size));
+        cout.flush();
+    }
+
+protected:
+    /// Return the given array of the mapped file after checking its size
+    template <typename Scalar> Scalar *section(const NMeshHeader &header, ENMeshSection index, uint64_t count,
+            bool optional, const std::string &filename) const {
+        const NMeshSection &section = header.sections[index];
+        if (section.size == 0 && optional)
+            return nullptr;
+        if (section.size != count * sizeof(Scalar) || section.offset % NMESH_ALIGNMENT != 0 ||
+                section.offset > m_file->size() || section.size > m_file->size() - section.offset)
+            throw NoriException("\"%s\" is corrupt!", filename);
+        return reinterpret_cast<Scalar *>(m_file->data() + section.offset);
+    }
+
+    std::unique_ptr<MemoryMappedFile> m_file;   ///< Memory the mesh data refers to
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "nmesh");
+NORI_NAMESPACE_END
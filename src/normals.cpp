@@ -12,15 +12,21 @@ NORI_NAMESPACE_BEGIN
         Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
             /* Find the surface that is visible in the requested direction */
             Intersection its;
-            if (!scene->rayIntersect(ray, its))
+            return LiPrimary(scene, sampler, ray, scene->rayIntersect(ray, its) ? &its : nullptr);
+        }
+
+        Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const {
+            if (!its)
                 return Color3f(0.0f);
 
             /* Return the component-wise absolute
                value of the shading normal as a color */
-            Normal3f n = its.shFrame.n.cwiseAbs();
+            Normal3f n = its->shFrame.n.cwiseAbs();
             return Color3f(n.x(), n.y(), n.z());
         }
 
+        bool usesRayPackets() const { return true; }
+
         std::string toString() const {
             return "NormalIntegrator[]";
         }
@@ -17,158 +17,481 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <cstring>
+#include <cstdlib>
+#include <cfloat>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is mapped into memory and split into chunks of whole lines,
+ * which are parsed in parallel. Polygons are triangulated as a fan. The
+ * face vertices (position/texture coordinate/normal triplets) are then
+ * deduplicated in parallel: they are distributed over buckets by their
+ * hash, and every bucket finds the first occurrence of each triplet. The
+ * vertices are numbered in the order of their first occurrence, so the
+ * result does not depend on the number of threads.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        m_compact = propList.getBoolean("compact", false);
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+        MemoryMappedFile file(filename.str());
+        const char *data = reinterpret_cast<const char *>(file.data());
+        size_t size = file.size();
+
+        /* Split the file at line ends */
+        std::vector<OBJChunk> chunks((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            size_t begin = i == 0 ? 0 : chunks[i - 1].end;
+            size_t end = std::min(std::max(begin, (i + 1) * CHUNK_SIZE), size);
+            const char *newline = (const char *) memchr(data + end, '\n', size - end);
+            chunks[i].begin = begin;
+            chunks[i].end = newline ? (size_t) (newline - data) + 1 : size;
+        }
+
+        /* Errors are reported by the chunks and thrown here, in file order */
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            try {
+                parseChunk(data, chunks[i]);
+            } catch (const NoriException &e) {
+                chunks[i].error = e.what();
             }
+        });
+        for (const OBJChunk &chunk : chunks) {
+            if (!chunk.error.empty())
+                throw NoriException("%s", chunk.error);
         }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        /* Offsets of the data of every chunk in the whole file */
+        uint32_t positionCount = 0, texcoordCount = 0, normalCount = 0;
+        size_t cornerCount = 0;
+        for (OBJChunk &chunk : chunks) {
+            chunk.positionOffset = positionCount;
+            chunk.texcoordOffset = texcoordCount;
+            chunk.normalOffset = normalCount;
+            chunk.cornerOffset = cornerCount;
+            positionCount += (uint32_t) (chunk.positions.size() / 3);
+            texcoordCount += (uint32_t) (chunk.texcoords.size() / 2);
+            normalCount += (uint32_t) (chunk.normals.size() / 3);
+            cornerCount += chunk.corners.size();
+        }
+        if (cornerCount / 3 > (size_t) std::numeric_limits<uint32_t>::max() / 3)
+            throw NoriException("\"%s\" has too many triangles!", filename);
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+        /* Transform the vertex data and gather the face vertices of all chunks */
+        std::vector<Point3f> positions(positionCount);
+        std::vector<Point2f> texcoords(texcoordCount);
+        std::vector<Normal3f> normals(normalCount);
+        std::vector<OBJVertex> corners(cornerCount);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            OBJChunk &chunk = chunks[i];
+            for (size_t j = 0; j < chunk.positions.size() / 3; ++j) {
+                Point3f p = trafo * Point3f(chunk.positions[3 * j], chunk.positions[3 * j + 1], chunk.positions[3 * j + 2]);
+                chunk.bbox.expandBy(p);
+                positions[chunk.positionOffset + j] = p;
+            }
+            for (size_t j = 0; j < chunk.texcoords.size() / 2; ++j)
+                texcoords[chunk.texcoordOffset + j] = Point2f(chunk.texcoords[2 * j], chunk.texcoords[2 * j + 1]);
+            for (size_t j = 0; j < chunk.normals.size() / 3; ++j) {
+                Normal3f n(chunk.normals[3 * j], chunk.normals[3 * j + 1], chunk.normals[3 * j + 2]);
+                normals[chunk.normalOffset + j] = (trafo * n).normalized();
+            }
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+            /* Relative indices were stored relative to the start of the chunk */
+            for (uint32_t fixup : chunk.relativeIndices) {
+                OBJVertex &v = chunk.corners[fixup / 3];
+                uint32_t &index = fixup % 3 == 0 ? v.p : (fixup % 3 == 1 ? v.uv : v.n);
+                index += fixup % 3 == 0 ? chunk.positionOffset
+                       : (fixup % 3 == 1 ? chunk.texcoordOffset : chunk.normalOffset);
+            }
+            for (const OBJVertex &v : chunk.corners) {
+                if (v.p >= positionCount || (texcoordCount > 0 && v.uv >= texcoordCount) ||
+                        (normalCount > 0 && v.n >= normalCount)) {
+                    chunk.error = tfm::format("\"%s\": face vertex %d/%d/%d refers to missing data!", filename,
+                                              (int) v.p + 1, (int) v.uv + 1, (int) v.n + 1);
+                    break;
+                }
+            }
+            std::copy(chunk.corners.begin(), chunk.corners.end(), corners.begin() + chunk.cornerOffset);
+            std::vector<float>().swap(chunk.positions);
+            std::vector<float>().swap(chunk.texcoords);
+            std::vector<float>().swap(chunk.normals);
+            std::vector<OBJVertex>().swap(chunk.corners);
+        });
+        for (const OBJChunk &chunk : chunks) {
+            if (!chunk.error.empty())
+                throw NoriException("%s", chunk.error);
+            m_bbox.expandBy(chunk.bbox);
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
-        }
+        /* First occurrence of every face vertex (see deduplicate()) */
+        std::vector<uint32_t> first = deduplicate(corners);
+
+        /* Number the vertices in the order of their first occurrence */
+        std::vector<uint32_t> vertexCounts(chunks.size() + 1, 0);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            size_t begin = chunks[i].cornerOffset, end = i + 1 < chunks.size() ? chunks[i + 1].cornerOffset : cornerCount;
+            for (size_t c = begin; c < end; ++c)
+                vertexCounts[i + 1] += first[c] == (uint32_t) c;
+        });
+        for (size_t i = 0; i < chunks.size(); ++i)
+            vertexCounts[i + 1] += vertexCounts[i];
+        uint32_t vertexCount = vertexCounts[chunks.size()];
+
+        m_F.resize(3, (Eigen::Index) (cornerCount / 3));
+        m_V.resize(3, vertexCount);
+        if (normalCount > 0)
+            m_N.resize(3, vertexCount);
+        if (texcoordCount > 0)
+            m_UV.resize(2, vertexCount);
+
+        uint32_t *indices = m_F.data();
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            size_t begin = chunks[i].cornerOffset, end = i + 1 < chunks.size() ? chunks[i + 1].cornerOffset : cornerCount;
+            uint32_t vertex = vertexCounts[i];
+            for (size_t c = begin; c < end; ++c) {
+                if (first[c] != (uint32_t) c)
+                    continue;
+                const OBJVertex &v = corners[c];
+                m_V.col(vertex) = positions[v.p];
+                if (normalCount > 0)
+                    m_N.col(vertex) = normals[v.n];
+                if (texcoordCount > 0)
+                    m_UV.col(vertex) = texcoords[v.uv];
+                indices[c] = vertex++;
+            }
+        });
+        /* The first occurrences are numbered now, all other face vertices refer to them */
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, cornerCount, 1 << 16),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t c = range.begin(); c < range.end(); ++c) {
+                    if (first[c] != (uint32_t) c)
+                        indices[c] = indices[first[c]];
+                }
+            }
+        );
 
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        /* A single write, the parser loads meshes concurrently */
+        cout << tfm::format("Loaded \"%s\" (V=%d, F=%d, took %s and %s)\n", filename, m_V.cols(), m_F.cols(),
+                            timer.elapsedString(), memString(m_F.size() * sizeof(uint32_t) +
+                                sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+        cout.flush();
     }
 
 protected:
-    /// Vertex indices used by the OBJ format
+    /// Number of bytes parsed by one task
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+    /// Number of buckets of the parallel vertex deduplication
+    static constexpr uint32_t DEDUP_BUCKETS = 256;
+
+    /// Vertex indices used by the OBJ format (zero-based, -1 if missing)
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
+        uint32_t n = (uint32_t) -1;
+
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
 
-        inline OBJVertex() { }
+        inline uint32_t hash() const {
+            uint32_t hash = p * 0x9e3779b1u;
+            hash = (hash ^ (hash >> 15) ^ uv) * 0x85ebca77u;
+            hash = (hash ^ (hash >> 13) ^ n) * 0xc2b2ae3du;
+            return hash ^ (hash >> 16);
+        }
+    };
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+    /// Data of a range of lines of the file
+    struct OBJChunk {
+        size_t begin, end;                      ///< Byte range in the file
+        std::vector<float> positions;           ///< Vertex positions (x, y, z)
+        std::vector<float> texcoords;           ///< Texture coordinates (u, v)
+        std::vector<float> normals;             ///< Normals (x, y, z)
+        std::vector<OBJVertex> corners;         ///< Face vertices, three per triangle
+        std::vector<uint32_t> relativeIndices;  ///< 3 * corner + attribute of indices relative to the chunk
+        uint32_t positionOffset, texcoordOffset, normalOffset;
+        size_t cornerOffset;
+        BoundingBox3f bbox;
+        std::string error;                      ///< Message of the first error in the chunk, if any
+    };
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+    /// Throw an exception that quotes the line containing \c pos
+    [[noreturn]] static void parseError(const char *data, const OBJChunk &chunk, const char *pos) {
+        const char *begin = pos, *end = pos;
+        while (begin > data + chunk.begin && begin[-1] != '\n')
+            --begin;
+        while (end < data + chunk.end && *end != '\n' && *end != '\r')
+            ++end;
+        throw NoriException("Unable to parse the OBJ line \"%s\"", std::string(begin, end));
+    }
+
+    static inline bool isSpace(char c) { return c == ' ' || c == '\t'; }
+    static inline bool isLineEnd(char c) { return c == '\n' || c == '\r' || c == '#'; }
 
-            p = toUInt(tokens[0]);
+    /// Parse a floating point number, correctly rounded like strtof()
+    static bool parseFloat(const char *&pos, const char *end, float &value) {
+        static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        const char *p = pos;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (mantissa < 100000000000000000ull)
+                mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+            else
+                exponent++;
+        }
+        if (p < end && *p == '.') {
+            for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+                if (mantissa < 100000000000000000ull) {
+                    mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                    exponent--;
+                }
+            }
+        }
+        if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExponent = false;
+            if (q < end && (*q == '-' || *q == '+'))
+                negativeExponent = *q++ == '-';
+            int e = 0;
+            const char *digitsBegin = q;
+            for (; q < end && *q >= '0' && *q <= '9'; ++q)
+                e = std::min(e * 10 + (*q - '0'), 100000);
+            if (q > digitsBegin) {
+                exponent += negativeExponent ? -e : e;
+                p = q;
+            }
+        }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        if (digits > 0 && mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+            /* Both operands are exact, so the double is correctly rounded. Rounding it
+               to float once more only differs from rounding the decimal number directly
+               if the double lies exactly halfway between two floats (or is subnormal
+               as a float, where fewer bits remain). */
+            double result = exponent < 0 ? (double) mantissa / powers[-exponent] : (double) mantissa * powers[exponent];
+            uint64_t bits;
+            memcpy(&bits, &result, sizeof(double));
+            bool halfway = (bits & 0x1fffffffull) == 0x10000000ull;
+            if (result == 0.0 || (!halfway && result >= FLT_MIN && result <= FLT_MAX)) {
+                value = (float) (negative ? -result : result);
+                pos = p;
+                return true;
+            }
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        /* Rare cases (very long numbers, large exponents, halfway cases, inf, nan) */
+        for (p = pos; p < end && !isSpace(*p) && !isLineEnd(*p); ++p)
+            ;
+        std::string token(pos, p);
+        char *parsed;
+        value = std::strtof(token.c_str(), &parsed);
+        if (parsed == token.c_str())
+            return false;
+        pos += parsed - token.c_str();
+        return true;
+    }
+
+    /// Parse an OBJ index, which is 1-based or negative (relative to the end)
+    static bool parseIndex(const char *&pos, const char *end, int64_t &value) {
+        const char *p = pos;
+        bool negative = p < end && *p == '-';
+        if (negative)
+            ++p;
+        const char *digitsBegin = p;
+        int64_t result = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+            result = std::min(result * 10 + (*p - '0'), (int64_t) 1 << 40);
+        if (p == digitsBegin || result == 0)
+            return false;
+        value = negative ? -result : result;
+        pos = p;
+        return true;
+    }
+
+    /// Convert an index to zero-based, relative ones are made relative to the start of the chunk
+    static uint32_t resolveIndex(int64_t index, size_t count, uint8_t &relative, int attribute) {
+        if (index > 0)
+            return (uint32_t) (index - 1);
+        relative |= (uint8_t) (1 << attribute);
+        return (uint32_t) ((int64_t) count + index);
+    }
+
+    /// Append a triangle corner and remember its indices that are relative to the chunk
+    static void addCorner(OBJChunk &chunk, const OBJVertex &v, uint8_t relative) {
+        for (int attribute = 0; attribute < 3; ++attribute) {
+            if (relative & (1 << attribute))
+                chunk.relativeIndices.push_back((uint32_t) (3 * chunk.corners.size() + attribute));
         }
-    };
+        chunk.corners.push_back(v);
+    }
+
+    static void parseChunk(const char *data, OBJChunk &chunk) {
+        const char *pos = data + chunk.begin, *end = data + chunk.end;
+        std::vector<OBJVertex> polygon;
+        std::vector<uint8_t> polygonRelative;
+
+        while (pos < end) {
+            while (pos < end && isSpace(*pos))
+                ++pos;
+            const char *line = pos;
+            int values = 0;
+            std::vector<float> *target = nullptr;
+
+            if (end - pos >= 2 && pos[0] == 'v' && isSpace(pos[1])) {
+                target = &chunk.positions;
+                values = 3;
+                pos += 2;
+            } else if (end - pos >= 3 && pos[0] == 'v' && pos[1] == 't' && isSpace(pos[2])) {
+                target = &chunk.texcoords;
+                values = 2;
+                pos += 3;
+            } else if (end - pos >= 3 && pos[0] == 'v' && pos[1] == 'n' && isSpace(pos[2])) {
+                target = &chunk.normals;
+                values = 3;
+                pos += 3;
+            } else if (end - pos >= 2 && pos[0] == 'f' && isSpace(pos[1])) {
+                pos += 2;
+                polygon.clear();
+                polygonRelative.clear();
+                while (true) {
+                    while (pos < end && isSpace(*pos))
+                        ++pos;
+                    if (pos == end || isLineEnd(*pos))
+                        break;
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+                    /* p, p/uv, p//n or p/uv/n */
+                    OBJVertex v;
+                    uint8_t relative = 0;
+                    int64_t index;
+                    if (!parseIndex(pos, end, index))
+                        parseError(data, chunk, line);
+                    v.p = resolveIndex(index, chunk.positions.size() / 3, relative, 0);
+                    if (pos < end && *pos == '/') {
+                        ++pos;
+                        if (pos < end && *pos != '/') {
+                            if (!parseIndex(pos, end, index))
+                                parseError(data, chunk, line);
+                            v.uv = resolveIndex(index, chunk.texcoords.size() / 2, relative, 1);
+                        }
+                        if (pos < end && *pos == '/') {
+                            ++pos;
+                            if (!parseIndex(pos, end, index))
+                                parseError(data, chunk, line);
+                            v.n = resolveIndex(index, chunk.normals.size() / 3, relative, 2);
+                        }
+                    }
+                    if (pos < end && !isSpace(*pos) && !isLineEnd(*pos))
+                        parseError(data, chunk, line);
+                    polygon.push_back(v);
+                    polygonRelative.push_back(relative);
+
+                    /* Fan triangulation, quads are split into (0, 1, 2) and (3, 0, 2) as before */
+                    size_t last = polygon.size() - 1;
+                    if (last == 2) {
+                        for (size_t k = 0; k < 3; ++k)
+                            addCorner(chunk, polygon[k], polygonRelative[k]);
+                    } else if (last > 2) {
+                        addCorner(chunk, polygon[last], polygonRelative[last]);
+                        addCorner(chunk, polygon[0], polygonRelative[0]);
+                        addCorner(chunk, polygon[last - 1], polygonRelative[last - 1]);
+                    }
+                }
+                if (polygon.size() < 3)
+                    parseError(data, chunk, line);
+            }
+
+            if (target) {
+                for (int i = 0; i < values; ++i) {
+                    while (pos < end && isSpace(*pos))
+                        ++pos;
+                    float value = 0.f;
+                    /* Texture coordinates may omit v */
+                    if (!parseFloat(pos, end, value) && !(target == &chunk.texcoords && i > 0))
+                        parseError(data, chunk, line);
+                    target->push_back(value);
+                }
+            }
+
+            const char *newline = (const char *) memchr(pos, '\n', (size_t) (end - pos));
+            pos = newline ? newline + 1 : end;
         }
-    };
+    }
+
+    /**
+     * \brief Return the index of the first occurrence of every face vertex
+     *
+     * The face vertices are distributed over buckets by their hash (in
+     * order), then every bucket is searched with its own hash table.
+     */
+    static std::vector<uint32_t> deduplicate(const std::vector<OBJVertex> &corners) {
+        size_t count = corners.size();
+        size_t blockSize = std::max((size_t) 1 << 16, (count + 63) / 64);
+        size_t blocks = (count + blockSize - 1) / blockSize;
+
+        /* Bucket sizes of every block, then the start of every bucket and block */
+        std::vector<uint32_t> offsets((size_t) DEDUP_BUCKETS * blocks + 1, 0);
+        tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+            size_t end = std::min(count, (block + 1) * blockSize);
+            for (size_t c = block * blockSize; c < end; ++c)
+                offsets[(size_t) (corners[c].hash() % DEDUP_BUCKETS) * blocks + block + 1]++;
+        });
+        for (size_t i = 1; i < offsets.size(); ++i)
+            offsets[i] += offsets[i - 1];
+
+        std::vector<uint32_t> sorted(count);
+        tbb::parallel_for(size_t(0), blocks, [&](size_t block) {
+            std::vector<uint32_t> position(DEDUP_BUCKETS);
+            for (uint32_t bucket = 0; bucket < DEDUP_BUCKETS; ++bucket)
+                position[bucket] = offsets[(size_t) bucket * blocks + block];
+            size_t end = std::min(count, (block + 1) * blockSize);
+            for (size_t c = block * blockSize; c < end; ++c)
+                sorted[position[corners[c].hash() % DEDUP_BUCKETS]++] = (uint32_t) c;
+        });
+
+        std::vector<uint32_t> first(count);
+        tbb::parallel_for(uint32_t(0), DEDUP_BUCKETS, [&](uint32_t bucket) {
+            uint32_t begin = offsets[(size_t) bucket * blocks], end = offsets[(size_t) (bucket + 1) * blocks];
+            uint32_t tableSize = 16;
+            while (tableSize < 2 * (end - begin))
+                tableSize *= 2;
+            std::vector<uint32_t> table(tableSize, (uint32_t) -1);
+
+            /* The face vertices of a bucket are in file order, the first one found is the first occurrence */
+            for (uint32_t i = begin; i < end; ++i) {
+                uint32_t c = sorted[i];
+                const OBJVertex &v = corners[c];
+                uint32_t slot = (v.hash() / DEDUP_BUCKETS) & (tableSize - 1);
+                while (table[slot] != (uint32_t) -1 && !(corners[table[slot]] == v))
+                    slot = (slot + 1) & (tableSize - 1);
+                if (table[slot] == (uint32_t) -1)
+                    table[slot] = c;
+                first[c] = table[slot];
+            }
+        });
+        return first;
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -19,13 +19,26 @@
 #include <nori/parser.h>
 #include <nori/proplist.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
 #include <pugixml.hpp>
 #include <fstream>
+#include <exception>
+#include <cstring>
+#include <cstdlib>
 #include <set>
 
 NORI_NAMESPACE_BEGIN
 
-NoriObject *loadFromXML(const std::string &filename) {
+PropertyOverride::PropertyOverride(const std::string &str) {
+    size_t dot = str.find('.'), equals = str.find('=');
+    if (dot == std::string::npos || equals == std::string::npos || dot == 0 || equals < dot + 2)
+        throw NoriException("Invalid property override \"%s\", expected \"tag.name=value\"", str);
+    tag = str.substr(0, dot);
+    name = str.substr(dot + 1, equals - dot - 1);
+    value = str.substr(equals + 1);
+}
+
+NoriObject *loadFromXML(const std::string &filename, const std::vector<PropertyOverride> &overrides) {
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(filename.c_str());
@@ -67,6 +80,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +97,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* Reference to an object with an "id" attribute */
+        ERef,
+
         EInvalid
     };
 
@@ -99,6 +116,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
+    tags["ref"]        = ERef;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -129,6 +148,16 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Objects that were declared with an "id" attribute */
+    std::map<std::string, NoriObject *> namedObjects;
+
+    /* Meshes that were created ahead of time (see below), or the error that occurred */
+    struct PreloadedMesh {
+        NoriObject *object = nullptr;
+        std::exception_ptr error;
+    };
+    std::map<pugi::xml_node, PreloadedMesh> preloadedMeshes;
+
     /* Helper function to parse a Nori XML node (recursive) */
     std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
         pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
@@ -168,8 +197,20 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
+        if (tag == ERef) {
+            /* Add a previously declared object to the parent once more */
+            check_attributes(node, { "id" });
+            auto object = namedObjects.find(node.attribute("id").value());
+            if (object == namedObjects.end())
+                throw NoriException("Error while parsing \"%s\": reference to unknown object \"%s\" at %s",
+                                    filename, node.attribute("id").value(), offset(node.offset_debug()));
+            return object->second;
+        }
+
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance)
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
@@ -184,13 +225,23 @@ NoriObject *loadFromXML(const std::string &filename) {
         NoriObject *result = nullptr;
         try {
             if (currentIsObject) {
-                check_attributes(node, { "type" });
-
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
+                if (!node.attribute("id").empty())
+                    check_attributes(node, { "type", "id" });
+                else
+                    check_attributes(node, { "type" });
+
+                /* This is an object, first instantiate it (unless it is a mesh that was loaded already) */
+                auto preloaded = preloadedMeshes.find(node);
+                if (preloaded != preloadedMeshes.end()) {
+                    if (preloaded->second.error)
+                        std::rethrow_exception(preloaded->second.error);
+                    result = preloaded->second.object;
+                } else {
+                    result = NoriObjectFactory::createInstance(
+                        node.attribute("type").value(),
+                        propList
+                    );
+                }
 
                 if (result->getClassType() != (int) tag) {
                     throw NoriException(
@@ -209,6 +260,13 @@ NoriObject *loadFromXML(const std::string &filename) {
 
                 /* Activate / configure the object */
                 result->activate();
+
+                if (!node.attribute("id").empty()) {
+                    std::string id = node.attribute("id").value();
+                    if (namedObjects.find(id) != namedObjects.end())
+                        throw NoriException("Duplicate object id \"%s\"", id);
+                    namedObjects[id] = result;
+                }
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -312,6 +370,98 @@ NoriObject *loadFromXML(const std::string &filename) {
         return result;
     };
 
+    /* Helper function: check if a string is an integer or floating point number */
+    auto isNumber = [](const std::string &str, bool integer) {
+        char *end = nullptr;
+        if (integer)
+            std::strtol(str.c_str(), &end, 10);
+        else
+            std::strtod(str.c_str(), &end);
+        return !str.empty() && *end == '\0';
+    };
+
+    /* Apply the property overrides to the document before anything is created */
+    std::function<void(pugi::xml_node)> applyOverrides = [&](pugi::xml_node node) {
+        for (pugi::xml_node ch: node.children()) {
+            if (ch.type() != pugi::node_element)
+                continue;
+            for (const PropertyOverride &o: overrides) {
+                if (o.tag != ch.name())
+                    continue;
+                pugi::xml_node prop = ch.find_child_by_attribute("name", o.name.c_str());
+                if (prop) {
+                    if (prop.attribute("value").empty())
+                        throw NoriException("Error while parsing \"%s\": property \"%s\" of \"%s\" cannot be overridden (at %s)",
+                                            filename, o.name, o.tag, offset(prop.offset_debug()));
+                    prop.attribute("value") = o.value.c_str();
+                    continue;
+                }
+
+                /* A missing property is added with the type its value suggests */
+                const char *type = "string";
+                if (o.value == "true" || o.value == "false")
+                    type = "boolean";
+                else if (isNumber(o.value, true))
+                    type = "integer";
+                else if (isNumber(o.value, false))
+                    type = "float";
+                prop = ch.prepend_child(type);
+                prop.append_attribute("name") = o.name.c_str();
+                prop.append_attribute("value") = o.value.c_str();
+            }
+            applyOverrides(ch);
+        }
+    };
+    applyOverrides(doc);
+
+    /* Loading the mesh files dominates, so all meshes are created concurrently
+       before the scene is assembled. Their constructors only depend on their
+       properties, the objects are attached to their parents in document order
+       as before. Errors are reported when the mesh is reached in the document. */
+    std::vector<pugi::xml_node> meshNodes;
+    std::function<void(const pugi::xml_node &)> findMeshes = [&](const pugi::xml_node &node) {
+        for (pugi::xml_node ch: node.children()) {
+            if (ch.type() != pugi::node_element)
+                continue;
+            if (strcmp(ch.name(), "mesh") == 0)
+                meshNodes.push_back(ch);
+            else
+                findMeshes(ch);
+        }
+    };
+    findMeshes(doc);
+
+    std::vector<pugi::xml_node> preloadNodes;
+    std::vector<PropertyList> preloadProps;
+    for (pugi::xml_node &meshNode: meshNodes) {
+        PropertyList propList;
+        try {
+            for (pugi::xml_node &ch: meshNode.children()) {
+                auto it = tags.find(ch.name());
+                if (ch.type() == pugi::node_element && it != tags.end() &&
+                    it->second >= EBoolean && it->second != ERef)
+                    parseTag(ch, propList, EMesh);
+            }
+        } catch (const NoriException &) {
+            /* Malformed properties are reported by the regular pass */
+            continue;
+        }
+        preloadNodes.push_back(meshNode);
+        preloadProps.push_back(propList);
+    }
+
+    std::vector<PreloadedMesh> preloaded(preloadNodes.size());
+    tbb::parallel_for(size_t(0), preloadNodes.size(), [&](size_t i) {
+        try {
+            preloaded[i].object = NoriObjectFactory::createInstance(
+                preloadNodes[i].attribute("type").value(), preloadProps[i]);
+        } catch (...) {
+            preloaded[i].error = std::current_exception();
+        }
+    });
+    for (size_t i = 0; i < preloadNodes.size(); ++i)
+        preloadedMeshes[preloadNodes[i]] = preloaded[i];
+
     PropertyList list;
     return parseTag(*doc.begin(), list, EInvalid);
 }
@@ -52,9 +52,14 @@ NORI_NAMESPACE_BEGIN
                 path_throughput *= its.mesh->getBSDF()->sample(bsdf_record, sampler->next2D());
                 ray = Ray3f(its.p, its.toWorld(bsdf_record.wo));
                 Intersection shading_its = its;
-                is_hit = scene->rayIntersect(ray, its);
+                // the surface information of the next vertex is only computed once it is needed
+                Accel::HitRecord hit;
+                is_hit = scene->rayIntersect(ray, hit);
+                bool has_its = false;
 
-                if (is_hit && its.mesh->isEmitter()) {
+                if (is_hit && hit.mesh->isEmitter()) {
+                    scene->computeSurfaceInteraction(hit, its);
+                    has_its = true;
                     EmitterQueryRecord emitter_record = EmitterQueryRecord(shading_its.p, shading_its.shFrame.n, its.p, its.shFrame.n);
                     float light_pdf = SceneUtils::getLightPdf(scene, its.mesh, emitter_record);
                     Color3f incoming_radiance = SceneUtils::getIncomingLightRadiance(emitter_record, its.mesh->getEmitter(), scene);
@@ -74,6 +79,9 @@ NORI_NAMESPACE_BEGIN
                     if (sampler->next1D() > continuation) break;
                 }
                 path_length++;
+
+                if (is_hit && !has_its)
+                    scene->computeSurfaceInteraction(hit, its);
             }
 
             return path_contribution;
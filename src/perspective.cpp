@@ -88,24 +88,17 @@ public:
     Color3f sampleRay(Ray3f &ray,
             const Point2f &samplePosition,
             const Point2f &apertureSample) const {
-        /* Compute the corresponding position on the 
-           near plane (in local camera space) */
-        Point3f nearP = m_sampleToCamera * Point3f(
-            samplePosition.x() * m_invOutputSize.x(),
-            samplePosition.y() * m_invOutputSize.y(), 0.0f);
-
-        /* Turn into a normalized ray direction, and
-           adjust the ray interval accordingly */
-        Vector3f d = nearP.normalized();
-        float invZ = 1.0f / d.z();
+        return samplePinholeRay(ray, m_cameraToWorld * Point3f(0, 0, 0), samplePosition);
+    }
 
-        ray.o = m_cameraToWorld * Point3f(0, 0, 0);
-        ray.d = m_cameraToWorld * d;
-        ray.mint = m_nearClip * invZ;
-        ray.maxt = m_farClip * invZ;
-        ray.update();
+    void sampleRayPacket(Ray3f *rays, Color3f *weights,
+            const Point2f *samplePositions,
+            const Point2f *apertureSamples, uint32_t count) const {
+        /* All rays of the pinhole camera share the same origin */
+        Point3f origin = m_cameraToWorld * Point3f(0, 0, 0);
 
-        return Color3f(1.0f);
+        for (uint32_t i = 0; i < count; ++i)
+            weights[i] = samplePinholeRay(rays[i], origin, samplePositions[i]);
     }
 
     void addChild(NoriObject *obj) {
@@ -141,6 +134,28 @@ public:
         );
     }
 private:
+    /// Sample the ray through a position on the image, given the world space camera position
+    Color3f samplePinholeRay(Ray3f &ray, const Point3f &origin, const Point2f &samplePosition) const {
+        /* Compute the corresponding position on the 
+           near plane (in local camera space) */
+        Point3f nearP = m_sampleToCamera * Point3f(
+            samplePosition.x() * m_invOutputSize.x(),
+            samplePosition.y() * m_invOutputSize.y(), 0.0f);
+
+        /* Turn into a normalized ray direction, and
+           adjust the ray interval accordingly */
+        Vector3f d = nearP.normalized();
+        float invZ = 1.0f / d.z();
+
+        ray.o = origin;
+        ray.d = m_cameraToWorld * d;
+        ray.mint = m_nearClip * invZ;
+        ray.maxt = m_farClip * invZ;
+        ray.update();
+
+        return Color3f(1.0f);
+    }
+
     Vector2f m_invOutputSize;
     Transform m_sampleToCamera;
     Transform m_cameraToWorld;
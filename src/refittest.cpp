@@ -0,0 +1,168 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scene.h>
+#include <nori/mesh.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Test of \ref Scene::refit()
+ *
+ * The vertices of all meshes of each scene are moved by a random offset,
+ * given per scene as a fraction of the diagonal of the mesh bounding box.
+ * After refitting, the scene must find exactly the same hits as an
+ * acceleration data structure that is built anew with the same settings.
+ * Small offsets keep the refitted hierarchy, large ones make it degrade so
+ * much that it has to be rebuilt; whether a rebuild is expected is given
+ * per scene as well. The reference only contains the meshes of the scene,
+ * so scenes with instances are not supported.
+ */
+class RefitTest : public NoriObject {
+public:
+    RefitTest(const PropertyList &propList) {
+        /* This parameter specifies the vertex offsets, one for each scene */
+        std::vector<std::string> displacements = tokenize(propList.getString("displacements", ""));
+        for (auto displacement : displacements)
+            m_displacements.push_back(toFloat(displacement));
+
+        /* This parameter specifies whether refitting has to rebuild, one for each scene */
+        std::vector<std::string> rebuilds = tokenize(propList.getString("rebuilds", ""));
+        for (auto rebuild : rebuilds)
+            m_rebuilds.push_back(toBool(rebuild));
+
+        /* Number of random rays that are compared (default: 100K) */
+        m_rayCount = propList.getInteger("rayCount", 100000);
+    }
+
+    virtual ~RefitTest() {
+        for (auto scene : m_scenes)
+            delete scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                m_scenes.push_back(static_cast<Scene *>(obj));
+                break;
+
+            default:
+                throw NoriException("RefitTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Deform, refit and compare each scene
+    void activate() {
+        if (m_displacements.size() != m_scenes.size() || m_rebuilds.size() != m_scenes.size())
+            throw NoriException("Specified a different number of scenes and displacements or rebuilds!");
+
+        int total = 0, passed = 0;
+        pcg32 random;
+
+        for (size_t i = 0; i < m_scenes.size(); ++i) {
+            Scene *scene = m_scenes[i];
+            const Accel *accel = scene->getAccel();
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing scene: " << scene->toString() << endl;
+            ++total;
+
+            cout << "Moving the vertices by " << m_displacements[i] << " .. " << endl;
+            for (auto mesh : scene->getMeshes()) {
+                MatrixXf positions = mesh->getVertexPositions();
+                float offset = m_displacements[i] * mesh->getBoundingBox().getExtents().norm();
+                for (int k = 0; k < positions.cols(); ++k)
+                    positions.col(k) += offset * (Vector3f(random.nextFloat(), random.nextFloat(),
+                        random.nextFloat()) * 2.f - Vector3f::Ones());
+                mesh->setVertexPositions(positions);
+            }
+
+            bool rebuilt = scene->refit();
+            if (rebuilt != m_rebuilds[i]) {
+                cout << "Refitting " << (rebuilt ? "rebuilt" : "did not rebuild") << " the "
+                     << accel->getTypeName() << ", but " << (m_rebuilds[i] ? "a" : "no")
+                     << " rebuild was expected" << endl;
+                continue;
+            }
+
+            /* Reference with the same settings, built from the deformed meshes */
+            Accel reference(accel->getType(), accel->getSIMDLevel() != Accel::ESIMDNone, accel->getNodeFormat());
+            reference.setWatertight(accel->isWatertight());
+            for (auto mesh : scene->getMeshes())
+                reference.addMesh(mesh);
+            reference.build();
+
+            /* Shoot rays from a sphere around the scene at random points within its bounds */
+            const BoundingBox3f &bbox = reference.getBoundingBox();
+            float radius = bbox.getExtents().norm();
+            cout << "Comparing " << m_rayCount << " rays .. " << endl;
+            int mismatches = 0;
+            for (int k = 0; k < m_rayCount; ++k) {
+                Point3f origin = bbox.getCenter() + radius *
+                    Warp::squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()));
+                Point3f target = bbox.min + Vector3f(random.nextFloat(), random.nextFloat(),
+                    random.nextFloat()).cwiseProduct(bbox.getExtents());
+                Ray3f ray(origin, (target - origin).normalized());
+
+                Accel::HitRecord hit, referenceHit;
+                bool found = scene->rayIntersect(ray, hit);
+                bool referenceFound = reference.rayIntersect(ray, referenceHit);
+                /* Rays through a shared edge may hit either triangle, so the distances are compared */
+                if (found == referenceFound && (!found || (hit.mesh == referenceHit.mesh &&
+                        std::abs(hit.t - referenceHit.t) <= 1e-5f * referenceHit.t)))
+                    continue;
+
+                if (mismatches++ < 10)
+                    cout << "Ray " << k << ": refitted " << (found ? tfm::format("triangle %i at t=%f",
+                        hit.triangle_idx, hit.t) : std::string("miss")) << ", rebuilt "
+                        << (referenceFound ? tfm::format("triangle %i at t=%f", referenceHit.triangle_idx,
+                        referenceHit.t) : std::string("miss")) << endl;
+            }
+
+            if (mismatches == 0)
+                ++passed;
+            cout << (mismatches == 0 ? "Accepted" : "Rejected") << ": " << mismatches
+                 << " of " << m_rayCount << " rays differ" << endl;
+        }
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "RefitTest[\n"
+            "  rayCount = %i\n"
+            "]",
+            m_rayCount
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    std::vector<Scene *> m_scenes;
+    std::vector<float> m_displacements;
+    std::vector<bool> m_rebuilds;
+    int m_rayCount;
+};
+
+NORI_REGISTER_CLASS(RefitTest, "refittest");
+NORI_NAMESPACE_END
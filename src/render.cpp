@@ -0,0 +1,376 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/render.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/timer.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+static const uint32_t minNoiseSampleCount = 8; /* Samples per pixel before the error estimates are used */
+static const uint32_t maxAdaptiveFactor = 8;   /* Pixels receive at most this many times the samples of a pass */
+static const int errorRadius = 1;              /* Pixel errors pool the samples of this neighborhood, see ImageBlock::getRelativeError() */
+
+/// Number of samples of every pixel in an adaptive pass
+typedef Eigen::Array<uint32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> SampleCountMap;
+
+static_assert(NORI_PACKET_SIZE * NORI_PACKET_SIZE <= MAX_RAY_PACKET_SIZE, "Camera ray packets are too large");
+
+/// Render a block for integrators that support packets, see Integrator::usesRayPackets()
+static void renderBlockPackets(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleCount,
+        const SampleCountMap *sampleCounts) {
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
+
+    Point2f pixelSamples[MAX_RAY_PACKET_SIZE], apertureSamples[MAX_RAY_PACKET_SIZE];
+    Ray3f rays[MAX_RAY_PACKET_SIZE];
+    Color3f weights[MAX_RAY_PACKET_SIZE];
+    Intersection its[MAX_RAY_PACKET_SIZE];
+
+    /* For each packet of NORI_PACKET_SIZE x NORI_PACKET_SIZE pixels and pixel sample */
+    for (int py=0; py<size.y(); py += NORI_PACKET_SIZE) {
+        for (int px=0; px<size.x(); px += NORI_PACKET_SIZE) {
+            int endY = std::min(py + NORI_PACKET_SIZE, size.y());
+            int endX = std::min(px + NORI_PACKET_SIZE, size.x());
+
+            /* With per-pixel sample counts, pixels drop out of the packet once they have all of theirs */
+            uint32_t packetSampleCount = sampleCount;
+            if (sampleCounts)
+                packetSampleCount = sampleCounts->block(offset.y() + py, offset.x() + px, endY - py, endX - px).maxCoeff();
+
+            for (uint32_t i=0; i<packetSampleCount; ++i) {
+                uint32_t count = 0;
+                for (int y=py; y<endY; ++y) {
+                    for (int x=px; x<endX; ++x) {
+                        if (sampleCounts && i >= (*sampleCounts)(offset.y() + y, offset.x() + x))
+                            continue;
+                        pixelSamples[count] = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                        apertureSamples[count] = sampler->next2D();
+                        ++count;
+                    }
+                }
+
+                /* Sample the camera rays and find their first intersections together */
+                camera->sampleRayPacket(rays, weights, pixelSamples, apertureSamples, count);
+                uint32_t hits = scene->rayIntersectPacket(rays, its, count);
+
+                for (uint32_t j=0; j<count; ++j) {
+                    /* Compute the incident radiance */
+                    Color3f value = weights[j] * integrator->LiPrimary(scene, sampler, rays[j],
+                        (hits & (1u << j)) ? &its[j] : nullptr);
+
+                    /* Store in the image block */
+                    block.put(pixelSamples[j], value);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief Render a block with \c sampleCount samples in every pixel
+ *
+ * If \c sampleCounts is given, it holds the number of samples of
+ * every pixel of the image instead.
+ */
+static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleCount,
+        const SampleCountMap *sampleCounts = nullptr) {
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
+
+    /* Clear the block contents */
+    block.clear();
+
+    if (integrator->usesRayPackets()) {
+        renderBlockPackets(scene, sampler, block, sampleCount, sampleCounts);
+        return;
+    }
+
+    /* For each pixel and pixel sample sample */
+    for (int y=0; y<size.y(); ++y) {
+        for (int x=0; x<size.x(); ++x) {
+            uint32_t pixelSampleCount = sampleCounts ? (*sampleCounts)(y + offset.y(), x + offset.x()) : sampleCount;
+            for (uint32_t i=0; i<pixelSampleCount; ++i) {
+                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
+
+                /* Sample a ray from the camera */
+                Ray3f ray;
+                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+
+                /* Compute the incident radiance */
+                value *= integrator->Li(scene, sampler, ray);
+
+                /* Store in the image block */
+                block.put(pixelSample, value);
+            }
+        }
+    }
+}
+
+/// Report the progress of a headless render in steps of 10 percent
+static void reportProgress(int done, int total) {
+    int percent = done * 100 / total;
+    if (percent / 10 == (done - 1) * 100 / total / 10)
+        return;
+    /* A single write, the workers report concurrently */
+    cout << tfm::format("Rendering .. %d%% (%d/%d blocks)\n", percent, done, total);
+    cout.flush();
+}
+
+/**
+ * \brief Render all blocks with the given number of samples per pixel
+ * (or those of \c sampleCounts, see \ref renderBlock()) and add them
+ * to the result
+ *
+ * Blocks that have not been started when \c deadline (in milliseconds
+ * of \c timer, zero for none) has passed are left out.
+ *
+ * \return The number of blocks that were rendered
+ */
+static int renderPass(const Scene *scene, BlockGenerator &blockGenerator, ImageBlock &result,
+        uint32_t pass, uint32_t sampleCount, const SampleCountMap *sampleCounts,
+        const Timer &timer, double deadline) {
+    const Camera *camera = scene->getCamera();
+    int blockCount = blockGenerator.getBlockCount();
+    std::atomic<int> blocksDone(0);
+    blockGenerator.reset();
+
+    tbb::blocked_range<int> range(0, blockCount);
+
+    auto map = [&](const tbb::blocked_range<int> &range) {
+        /* Allocate memory for a small image block to be rendered
+           by the current thread */
+        ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
+            camera->getReconstructionFilter());
+        if (result.tracksVariance())
+            block.trackVariance();
+
+        /* Create a clone of the sampler for the current thread */
+        std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+
+        for (int i=range.begin(); i<range.end(); ++i) {
+            if (deadline > 0 && timer.elapsed() >= deadline)
+                return;
+
+            /* Request an image block from the block generator */
+            blockGenerator.next(block);
+
+            /* Blocks whose pixels are all converged have nothing to add */
+            if (sampleCounts && (sampleCounts->block(block.getOffset().y(), block.getOffset().x(),
+                    block.getSize().y(), block.getSize().x()) == 0).all()) {
+                ++blocksDone;
+                continue;
+            }
+
+            /* Inform the sampler about the block to be rendered */
+            sampler->prepare(block, pass);
+
+            /* Render all contained pixels */
+            renderBlock(scene, sampler.get(), block, sampleCount, sampleCounts);
+
+            /* The image block has been processed. Now add it to
+               the "big" block that represents the entire image */
+            result.put(block);
+
+            int done = ++blocksDone;
+            if (getRenderSettings()->reportProgress && !getRenderSettings()->progressive)
+                reportProgress(done, blockCount);
+        }
+    };
+
+    /// Default: parallel rendering
+    tbb::parallel_for(range, map);
+
+    /// (equivalent to the following single-threaded call)
+    // map(range);
+
+    return blocksDone;
+}
+
+/// Return the number of pixels whose relative error is above the noise threshold
+static int countNoisyPixels(const ImageBlock &result) {
+    int count = 0;
+    for (int y=0; y<result.getSize().y(); ++y)
+        for (int x=0; x<result.getSize().x(); ++x)
+            if (result.getRelativeError(Point2i(x, y), errorRadius) > getRenderSettings()->noiseThreshold)
+                ++count;
+    return count;
+}
+
+/**
+ * \brief Distribute the samples of an adaptive pass over the pixels
+ *
+ * Every pixel above the noise threshold receives a share of \c budget
+ * samples in proportion to its relative error, but no more than
+ * \c maxCount. Converged pixels receive none.
+ *
+ * \return The number of samples that were handed out
+ */
+static uint64_t distributeSamples(const ImageBlock &result, uint64_t budget, uint32_t maxCount,
+        SampleCountMap &sampleCounts) {
+    Vector2i size = result.getSize();
+    Eigen::ArrayXXf errors(size.y(), size.x());
+    double errorSum = 0;
+    for (int y=0; y<size.y(); ++y) {
+        for (int x=0; x<size.x(); ++x) {
+            float error = result.getRelativeError(Point2i(x, y), errorRadius);
+            errors(y, x) = error > getRenderSettings()->noiseThreshold ? error : 0.f;
+            errorSum += errors(y, x);
+        }
+    }
+
+    sampleCounts.resize(size.y(), size.x());
+    uint64_t assigned = 0;
+    double carry = 0;
+    for (int y=0; y<size.y(); ++y) {
+        for (int x=0; x<size.x(); ++x) {
+            if (errors(y, x) == 0) {
+                sampleCounts(y, x) = 0;
+                continue;
+            }
+            /* Carry the rounding error over to the next pixel, so that the
+               total matches the budget unless pixels reach the maximum */
+            double share = budget * (errors(y, x) / errorSum) + carry;
+            uint32_t count = (uint32_t) std::min(share, (double) maxCount);
+            carry = count < maxCount ? share - count : 0;
+            sampleCounts(y, x) = count;
+            assigned += count;
+        }
+    }
+    return assigned;
+}
+
+/// Return the number of samples of every block in the scanline order of \ref BlockGenerator::getBlockIndex()
+static std::vector<float> blockSampleCounts(const SampleCountMap &sampleCounts) {
+    int rows = (int) sampleCounts.rows(), cols = (int) sampleCounts.cols();
+    std::vector<float> counts;
+    for (int y=0; y<rows; y += NORI_BLOCK_SIZE)
+        for (int x=0; x<cols; x += NORI_BLOCK_SIZE)
+            counts.push_back(sampleCounts.block(y, x, std::min(NORI_BLOCK_SIZE, rows - y),
+                                                        std::min(NORI_BLOCK_SIZE, cols - x)).cast<float>().sum());
+    return counts;
+}
+
+/**
+ * \brief Render the image in passes over all blocks, adding
+ * the samples per pixel of a pass each time
+ *
+ * The result is a complete image after every pass. Rendering stops
+ * once \c targetCount samples per pixel are taken, when the time
+ * budget is used up or when no pixel is above the noise threshold
+ * anymore.
+ *
+ * In adaptive mode, all pixels receive the same number of samples only
+ * until the error estimates can be trusted. Later passes take as many
+ * samples as before in total, but distribute them by the error of the
+ * pixels, so that converged regions stop taking any.
+ */
+static void renderProgressive(const Scene *scene, BlockGenerator &blockGenerator, ImageBlock &result,
+        uint32_t targetCount) {
+    const RenderSettings &settings = *getRenderSettings();
+    uint32_t passSampleCount = settings.passSampleCount;
+    Timer timer;
+    double deadline = settings.timeBudget * 1000;
+    uint64_t pixelCount = (uint64_t) result.getSize().prod();
+    uint64_t sampleBudget = targetCount * pixelCount;
+    uint64_t samplesTaken = 0;
+    SampleCountMap sampleCounts;
+
+    for (uint32_t pass = 0; samplesTaken < sampleBudget; ++pass) {
+        if (deadline > 0 && timer.elapsed() >= deadline) {
+            cout << "Time budget exhausted" << endl;
+            break;
+        }
+
+        Timer passTimer;
+        uint64_t passBudget = std::min(passSampleCount * pixelCount, sampleBudget - samplesTaken);
+        uint32_t passCount = 0;
+        uint64_t passSamples = 0;
+        if (settings.adaptive && samplesTaken >= minNoiseSampleCount * pixelCount) {
+            passSamples = distributeSamples(result, passBudget, passSampleCount * maxAdaptiveFactor, sampleCounts);
+            if (passSamples == 0)
+                break;
+            /* Start with the blocks that take most samples, they take longest */
+            blockGenerator.sortByCost(blockSampleCounts(sampleCounts));
+        } else {
+            passCount = (uint32_t) (passBudget / pixelCount);
+            passSamples = passCount * pixelCount;
+        }
+
+        int blocks = renderPass(scene, blockGenerator, result, pass, passCount,
+                                passCount > 0 ? nullptr : &sampleCounts, timer, deadline);
+        if (blocks < blockGenerator.getBlockCount()) {
+            cout << tfm::format("Pass %d: time budget exhausted after %d of %d blocks\n",
+                                pass + 1, blocks, blockGenerator.getBlockCount());
+            break;
+        }
+        samplesTaken += passSamples;
+
+        int noisyPixels = -1;
+        if (settings.noiseThreshold > 0 && samplesTaken >= minNoiseSampleCount * pixelCount)
+            noisyPixels = countNoisyPixels(result);
+
+        cout << tfm::format("Pass %d: %.1f spp (took %s)", pass + 1, samplesTaken / (double) pixelCount,
+                            passTimer.elapsedString());
+        if (noisyPixels >= 0)
+            cout << tfm::format(", %d pixels above the noise threshold", noisyPixels);
+        cout << endl;
+
+        if (noisyPixels == 0)
+            break;
+    }
+}
+
+RenderSettings *getRenderSettings() {
+    static RenderSettings settings;
+    return &settings;
+}
+
+void renderImage(const Scene *scene, ImageBlock &result) {
+    const RenderSettings &settings = *getRenderSettings();
+
+    /* Create a block generator (i.e. a work scheduler) */
+    BlockGenerator blockGenerator(result.getSize(), NORI_BLOCK_SIZE, settings.blockOrder);
+
+    if (settings.noiseThreshold > 0 || settings.adaptive)
+        result.trackVariance();
+
+    uint32_t targetCount = settings.targetSampleCount > 0 ? settings.targetSampleCount
+                                                          : (uint32_t) scene->getSampler()->getSampleCount();
+    if (settings.progressive) {
+        renderProgressive(scene, blockGenerator, result, targetCount);
+    } else {
+        Timer timer;
+        renderPass(scene, blockGenerator, result, 0, targetCount, nullptr, timer, 0);
+    }
+}
+
+NORI_NAMESPACE_END
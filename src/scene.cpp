@@ -22,11 +22,58 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <filesystem/resolver.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &props) {
+    /* Hierarchy used for ray intersection queries ("bvh", "octree" or "sbvh"). Default: BVH */
+    std::string accel = props.getString("accel", "bvh");
+    /* Use SSE/AVX2 traversal kernels when supported by the CPU. Default: true */
+    bool simd = props.getBoolean("simd", true);
+    /* Precision of the node bounding boxes ("full", "quantized16" or "quantized8").
+       Quantized boxes need less memory but are less tight. Default: full */
+    std::string nodes = props.getString("nodes", "full");
+    Accel::ENodeFormat node_format;
+    if (nodes == "full")
+        node_format = Accel::EFullPrecision;
+    else if (nodes == "quantized16")
+        node_format = Accel::EQuantized16;
+    else if (nodes == "quantized8")
+        node_format = Accel::EQuantized8;
+    else
+        throw NoriException("Scene: unknown node format \"%s\"!", nodes);
+
+    if (accel == "bvh")
+        m_accel = new Accel(Accel::EBVH, simd, node_format);
+    else if (accel == "octree")
+        m_accel = new Accel(Accel::EOctree, simd, node_format);
+    else if (accel == "sbvh")
+        m_accel = new Accel(Accel::ESBVH, simd, node_format);
+    else
+        throw NoriException("Scene: unknown acceleration data structure \"%s\"!", accel);
+
+    /* Additional triangle references the spatial splits of "sbvh" may create,
+       relative to the number of triangles. Default: 0.3 */
+    float split_budget = props.getFloat("splitBudget", 0.3f);
+    if (split_budget < 0.f)
+        throw NoriException("Scene: the split budget must be positive!");
+    m_accel->setSplitBudget(split_budget);
+
+    /* Use the watertight ray-triangle test, which closes the cracks between
+       adjacent triangles at a small cost. Default: false */
+    m_accel->setWatertight(props.getBoolean("watertight", false));
+
+    /* File that keeps the built acceleration data structure between runs, relative
+       paths refer to the directory of the scene. Default: none */
+    std::string cache = props.getString("cache", "");
+    if (!cache.empty()) {
+        filesystem::path path = getFileResolver()->resolve(cache);
+        if (!path.exists() && !path.is_absolute() && getFileResolver()->size() > 0)
+            path = (*getFileResolver())[0] / path;
+        m_accel->setCacheFile(path.str());
+    }
 }
 
 Scene::~Scene() {
@@ -34,6 +81,8 @@ Scene::~Scene() {
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (auto instance : m_instances)
+        delete instance;
 }
 
 void Scene::activate() {
@@ -68,6 +117,13 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
         
+        case EInstance: {
+                Instance *instance = static_cast<Instance *>(obj);
+                m_accel->addInstance(instance->getMesh(), instance->getTransform());
+                m_instances.push_back(instance);
+            }
+            break;
+
         case EEmitter: {
                 //Emitter *emitter = static_cast<Emitter *>(obj);
                 /* TBD */
@@ -114,12 +170,14 @@ std::string Scene::toString() const {
         "  sampler = %s\n"
         "  camera = %s,\n"
         "  meshes = {\n"
-        "  %s  }\n"
+        "  %s  },\n"
+        "  instances = %i\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
-        indent(meshes, 2)
+        indent(meshes, 2),
+        m_instances.size()
     );
 }
 
@@ -13,10 +13,13 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
+        return LiPrimary(scene, sampler, ray, scene->rayIntersect(ray, its) ? &its : nullptr);
+    }
 
-        if (!scene->rayIntersect(ray, its))
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *hit) const override {
+        if (!hit)
             return {0.0f};
-
+        const Intersection &its = *hit;
 
         Vector3f l = m_position - its.p;
         float dist = l.squaredNorm();
@@ -30,6 +33,8 @@ public:
         return m_energy / (4 * M_PI * M_PI) * fmax(0, cos_theta) / dist;
     }
 
+    bool usesRayPackets() const override { return true; }
+
     std::string toString() const {
         return "SimpleIntegrator[ position: " + m_position.toString() + ", energy: " + m_energy.toString() + " ]";
     }
@@ -21,6 +21,9 @@
 #include <nori/camera.h>
 #include <nori/integrator.h>
 #include <nori/sampler.h>
+#include <nori/bitmap.h>
+#include <nori/rfilter.h>
+#include <nori/render.h>
 #include <hypothesis.h>
 #include <pcg32.h>
 
@@ -54,6 +57,12 @@ NORI_NAMESPACE_BEGIN
  *
  * 2. that the average radiance received by a camera within some scene
  *    matches a given value (modulo noise).
+ *
+ * Scenes can also be rendered with the block renderer of nori, using the
+ * settings given on the command line (e.g. "--progressive --spp 16"), in
+ * which case the pixel values of the image are tested instead. This
+ * requires a camera that sees the same radiance in every pixel and a box
+ * filter, which keeps the pixels independent.
  */
 class StudentsTTest : public NoriObject {
 public:
@@ -74,6 +83,9 @@ public:
 
         /* Number of BSDF samples that should be generated (default: 100K) */
         m_sampleCount = propList.getInteger("sampleCount", 100000);
+
+        /* Render the scenes with the block renderer and test the mean of the pixels (default: false) */
+        m_renderImage = propList.getBoolean("renderImage", false);
     }
 
     virtual ~StudentsTTest() {
@@ -161,31 +173,53 @@ public:
                 cout << "Testing scene: " << scene->toString() << endl;
                 ++total;
 
-                cout << "Generating " << m_sampleCount << " paths.. " << endl;
-
                 double mean = 0, variance = 0;
-                for (int k=0; k<m_sampleCount; ++k) {
-                    /* Sample a ray from the camera */
-                    Ray3f ray;
-                    Point2f pixelSample = (sampler->next2D().array()
-                        * camera->getOutputSize().cast<float>().array()).matrix();
-                    Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
-
-                    /* Compute the incident radiance */
-                    value *= integrator->Li(scene, sampler, ray);
-
-                    /* Numerically robust online variance estimation using an
-                       algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
-                    double result = (double) value.getLuminance();
-                    double delta = result - mean;
-                    mean += delta / (double) (k+1);
-                    variance += delta * (result - mean);
+                int sampleCount = m_sampleCount;
+                if (m_renderImage) {
+                    if (camera->getReconstructionFilter()->getRadius() > 0.5f)
+                        throw NoriException("StudentsTTest: rendered scenes require a box filter!");
+
+                    cout << "Rendering the image with the block renderer .. " << endl;
+                    scene->getIntegrator()->preprocess(scene);
+                    ImageBlock block(camera->getOutputSize(), camera->getReconstructionFilter());
+                    block.clear();
+                    renderImage(scene, block);
+                    std::unique_ptr<Bitmap> bitmap(block.toBitmap());
+
+                    /* Every pixel value is one sample of the mean radiance */
+                    sampleCount = (int) bitmap->size();
+                    for (int k=0; k<sampleCount; ++k) {
+                        double result = (double) (*bitmap)(k).getLuminance();
+                        double delta = result - mean;
+                        mean += delta / (double) (k+1);
+                        variance += delta * (result - mean);
+                    }
+                } else {
+                    cout << "Generating " << m_sampleCount << " paths.. " << endl;
+
+                    for (int k=0; k<m_sampleCount; ++k) {
+                        /* Sample a ray from the camera */
+                        Ray3f ray;
+                        Point2f pixelSample = (sampler->next2D().array()
+                            * camera->getOutputSize().cast<float>().array()).matrix();
+                        Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
+
+                        /* Compute the incident radiance */
+                        value *= integrator->Li(scene, sampler, ray);
+
+                        /* Numerically robust online variance estimation using an
+                           algorithm proposed by Donald Knuth (TAOCP vol.2, 3rd ed., p.232) */
+                        double result = (double) value.getLuminance();
+                        double delta = result - mean;
+                        mean += delta / (double) (k+1);
+                        variance += delta * (result - mean);
+                    }
                 }
-                variance /= m_sampleCount - 1;
+                variance /= sampleCount - 1;
 
                 std::pair<bool, std::string>
                     result = hypothesis::students_t_test(mean, variance, reference,
-                        m_sampleCount, m_significanceLevel, (int) m_references.size());
+                        sampleCount, m_significanceLevel, (int) m_references.size());
 
                 if (result.first)
                     ++passed;
@@ -201,10 +235,12 @@ public:
         return tfm::format(
             "StudentsTTest[\n"
             "  significanceLevel = %f,\n"
-            "  sampleCount= %i\n"
+            "  sampleCount= %i,\n"
+            "  renderImage = %s\n"
             "]",
             m_significanceLevel,
-            m_sampleCount
+            m_sampleCount,
+            m_renderImage ? "true" : "false"
         );
     }
 
@@ -216,6 +252,7 @@ private:
     std::vector<float> m_references;
     float m_significanceLevel;
     int m_sampleCount;
+    bool m_renderImage;
 };
 
 NORI_REGISTER_CLASS(StudentsTTest, "ttest");
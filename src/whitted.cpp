@@ -14,11 +14,16 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
+        return LiPrimary(scene, sampler, ray, scene->rayIntersect(ray, its) ? &its : nullptr);
+    }
+
+    Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *hit) const override {
         Color3f light_eval(0.f);
         Color3f emitted_light(0.f);
 
-        if (!scene->rayIntersect(ray, its))
+        if (!hit)
             return {0.0f};
+        const Intersection &its = *hit;
 
         if (its.mesh->getBSDF()->isDiffuse()) {
             // diffuse shading
@@ -61,6 +66,8 @@ public:
         }
     }
 
+    bool usesRayPackets() const override { return true; }
+
     std::string toString() const {
         return "WhittedIntegrator[]";
     }